@@ -0,0 +1,208 @@
+//--------------------------------------------------------------------------------------
+// Floats rigid bodies such as crates and boats on a CWaveGrid
+//--------------------------------------------------------------------------------------
+
+#include "Buoyancy.h"
+#include "CMatrix4x4.h"
+#include "MathHelpers.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+// Probe i sits at the centre of octant i of the hull, as a fraction of the half size along each axis
+static const float PROBE_SIGN[BuoyancySystem::PROBES_PER_BODY][3] = {
+	{ -0.5f, -0.5f, -0.5f }, { 0.5f, -0.5f, -0.5f }, { -0.5f, -0.5f, 0.5f }, { 0.5f, -0.5f, 0.5f },
+	{ -0.5f,  0.5f, -0.5f }, { 0.5f,  0.5f, -0.5f }, { -0.5f,  0.5f, 0.5f }, { 0.5f,  0.5f, 0.5f },
+};
+
+// Turns three nearly orthonormal axes back into exact ones, keeping the direction of the first
+static void Orthonormalise(CVector3 axes[3])
+{
+	axes[0] = Normalise(axes[0]);
+	axes[1] = Normalise(axes[1] - axes[0] * Dot(axes[0], axes[1]));
+	axes[2] = Cross(axes[0], axes[1]);
+}
+
+
+BuoyancySystem::BuoyancySystem(CWaveGrid* grid, float timeStep)
+	: mGrid(grid), mTimeStep(timeStep), mAccumulator(0), mLastUpdateTime(0), mWaves(nullptr)
+{
+}
+
+
+int BuoyancySystem::AddBody(Model* model, CVector3 halfSize, float density)
+{
+	const CMatrix4x4 world = model->WorldMatrix();
+
+	Body body;
+	body.model = model;
+	body.scale = world.GetScale();
+	body.halfSize = halfSize;
+	body.position = world.GetPosition();
+	body.velocity = { 0, 0, 0 };
+	for (int i = 0; i < 3; ++i)  body.axes[i] = world.GetRow(i);
+	Orthonormalise(body.axes);
+	body.angularVelocity = { 0, 0, 0 };
+	body.previousPosition = body.position;
+	for (int i = 0; i < 3; ++i)  body.previousAxes[i] = body.axes[i];
+
+	// A solid box of mass m and half sizes a, b, c has moment m (b^2 + c^2) / 3 about its x axis, and so on
+	const float volume = 8.0f * halfSize.x * halfSize.y * halfSize.z;
+	body.mass = density * volume;
+	const CVector3 square = { halfSize.x * halfSize.x, halfSize.y * halfSize.y, halfSize.z * halfSize.z };
+	body.inverseInertia = { 3.0f / (body.mass * (square.y + square.z)),
+	                        3.0f / (body.mass * (square.x + square.z)),
+	                        3.0f / (body.mass * (square.x + square.y)) };
+	body.probeVolume = volume / PROBES_PER_BODY;
+	body.probeRadius = std::sqrt(halfSize.x * halfSize.z / PI);
+	mBodies.push_back(body);
+
+	const size_t numProbes = mBodies.size() * PROBES_PER_BODY;
+	mProbeX.resize(numProbes);
+	mProbeY.resize(numProbes);
+	mProbeZ.resize(numProbes);
+	mSurfaceHeight.resize(numProbes);
+	mWaterVelocity.resize(numProbes);
+	mSubmergedVolume.resize(numProbes);
+	mImprintX.resize(numProbes);
+	mImprintZ.resize(numProbes);
+	mImprintVolume.resize(numProbes);
+
+	return static_cast<int>(mBodies.size()) - 1;
+}
+
+
+void BuoyancySystem::SetInteractiveWaves(InteractiveWaves* waves)
+{
+	mWaves = waves;
+	std::fill(mImprintVolume.begin(), mImprintVolume.end(), 0.0f);
+}
+
+
+void BuoyancySystem::Update(float frameTime)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	mAccumulator += frameTime;
+	int steps = 0;
+	while (mAccumulator >= mTimeStep && steps < MAX_STEPS)
+	{
+		Step();
+		mAccumulator -= mTimeStep;
+		++steps;
+	}
+	mAccumulator = std::fmod(mAccumulator, mTimeStep);
+
+	// Show each body part way from its previous step to its current one, as far as the time left over
+	const float blend = mAccumulator / mTimeStep;
+	for (Body& body : mBodies)
+	{
+		CVector3 axes[3];
+		for (int i = 0; i < 3; ++i)  axes[i] = body.previousAxes[i] + (body.axes[i] - body.previousAxes[i]) * blend;
+		Orthonormalise(axes);
+
+		CMatrix4x4 world = MatrixIdentity();
+		world.SetRow(0, axes[0] * body.scale.x);
+		world.SetRow(1, axes[1] * body.scale.y);
+		world.SetRow(2, axes[2] * body.scale.z);
+		world.SetRow(3, body.previousPosition + (body.position - body.previousPosition) * blend);
+		body.model->SetWorldMatrix(world);
+	}
+
+	mLastUpdateTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+void BuoyancySystem::PlaceProbes()
+{
+	int probe = 0;
+	for (const Body& body : mBodies)
+	{
+		const CVector3 x = body.axes[0] * body.halfSize.x;
+		const CVector3 y = body.axes[1] * body.halfSize.y;
+		const CVector3 z = body.axes[2] * body.halfSize.z;
+		for (int i = 0; i < PROBES_PER_BODY; ++i, ++probe)
+		{
+			const CVector3 position = body.position + x * PROBE_SIGN[i][0] + y * PROBE_SIGN[i][1] + z * PROBE_SIGN[i][2];
+			mProbeX[probe] = position.x;
+			mProbeY[probe] = position.y;
+			mProbeZ[probe] = position.z;
+		}
+	}
+
+	mGrid->QuerySurface(probe, mProbeX.data(), mProbeZ.data(), mSurfaceHeight.data(), nullptr, mWaterVelocity.data());
+}
+
+
+void BuoyancySystem::Step()
+{
+	for (Body& body : mBodies)
+	{
+		body.previousPosition = body.position;
+		for (int i = 0; i < 3; ++i)  body.previousAxes[i] = body.axes[i];
+	}
+
+	PlaceProbes();
+
+	int probe = 0;
+	for (Body& body : mBodies)
+	{
+		// Height of the octant each probe stands for, whichever way up the body is
+		const float probeHeight = std::abs(body.axes[0].y) * body.halfSize.x + std::abs(body.axes[1].y) * body.halfSize.y +
+		                          std::abs(body.axes[2].y) * body.halfSize.z;
+
+		CVector3 force = { 0, -GRAVITY * body.mass, 0 };
+		CVector3 torque = { 0, 0, 0 };
+		float submerged = 0;
+		for (int i = 0; i < PROBES_PER_BODY; ++i, ++probe)
+		{
+			const float fraction = std::min(std::max((mSurfaceHeight[probe] - mProbeY[probe]) / probeHeight + 0.5f, 0.0f), 1.0f);
+			mSubmergedVolume[probe] = body.probeVolume * fraction;
+			if (fraction <= 0)  continue;
+			submerged += fraction;
+
+			// Buoyancy lifts the submerged volume, drag pulls the probe along with the water around it
+			const CVector3 offset = CVector3{ mProbeX[probe], mProbeY[probe], mProbeZ[probe] } - body.position;
+			const CVector3 probeVelocity = body.velocity + Cross(body.angularVelocity, offset);
+			const float displaced = WATER_DENSITY * body.probeVolume * fraction;
+			CVector3 probeForce = (mWaterVelocity[probe] - probeVelocity) * (LINEAR_DRAG * displaced);
+			probeForce.y += GRAVITY * displaced;
+
+			force += probeForce;
+			torque += Cross(offset, probeForce);
+		}
+		submerged /= PROBES_PER_BODY;
+
+		// Semi-implicit Euler: velocities first, then positions with the new velocities. The torque is turned into
+		// angular acceleration about each of the body's own axes, where the inertia is diagonal
+		CVector3 angularAcceleration = { 0, 0, 0 };
+		for (int i = 0; i < 3; ++i)
+		{
+			const float inverseInertia = i == 0 ? body.inverseInertia.x : i == 1 ? body.inverseInertia.y : body.inverseInertia.z;
+			angularAcceleration += body.axes[i] * (Dot(body.axes[i], torque) * inverseInertia);
+		}
+		body.velocity += force * (mTimeStep / body.mass);
+		body.angularVelocity += angularAcceleration * mTimeStep;
+		body.angularVelocity *= std::max(1.0f - ANGULAR_DRAG * submerged * mTimeStep, 0.0f);
+
+		body.position += body.velocity * mTimeStep;
+		for (int i = 0; i < 3; ++i)  body.axes[i] += Cross(body.angularVelocity, body.axes[i]) * mTimeStep;
+		Orthonormalise(body.axes);
+	}
+
+	if (mWaves)
+	{
+		probe = 0;
+		for (const Body& body : mBodies)
+		{
+			for (int i = 0; i < PROBES_PER_BODY; ++i, ++probe)
+			{
+				if (mImprintVolume[probe] != 0)  mWaves->Displace(mImprintX[probe], mImprintZ[probe], body.probeRadius, -mImprintVolume[probe]);
+				if (mSubmergedVolume[probe] != 0)  mWaves->Displace(mProbeX[probe], mProbeZ[probe], body.probeRadius, mSubmergedVolume[probe]);
+				mImprintX[probe] = mProbeX[probe];
+				mImprintZ[probe] = mProbeZ[probe];
+				mImprintVolume[probe] = mSubmergedVolume[probe];
+			}
+		}
+	}
+}
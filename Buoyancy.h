@@ -0,0 +1,103 @@
+//--------------------------------------------------------------------------------------
+// Floats rigid bodies such as crates and boats on a CWaveGrid
+//--------------------------------------------------------------------------------------
+// Each body has a box hull sampled at PROBES_PER_BODY probe points, one at the centre of each octant, each standing
+// for an equal share of the hull's volume. Every step the probes of all bodies are looked up on the ocean in one
+// batched CWaveGrid::QuerySurface call. The submerged part of each probe is pushed up by the weight of the water it
+// displaces and dragged towards the water's own velocity, and the resulting forces and torques are integrated with a
+// fixed timestep. Model world matrices are written once per Update, blended between the last two steps so motion
+// stays smooth whatever the frame rate. Given InteractiveWaves, each probe also pushes aside the water it has
+// submerged, taking back what it displaced the step before, so bodies make ripples as they fall in, bob and move.
+
+#ifndef _BUOYANCY_H_INCLUDED_
+#define _BUOYANCY_H_INCLUDED_
+
+#include "CWaterGrid.h"
+#include "InteractiveWaves.h"
+#include "Model.h"
+#include "CVector3.h"
+#include <vector>
+
+class BuoyancySystem
+{
+public:
+
+	// Construction //
+
+	// Bodies float on grid, which must outlive the system. timeStep is the fixed step in seconds
+	BuoyancySystem(CWaveGrid* grid, float timeStep = 1.0f / 60.0f);
+
+
+	// Usage //
+
+	// Floats model as a box of the given half size along its own axes (in world units, not scaled further by the
+	// model) and density in kg/m^3, water being WATER_DENSITY, so 500 floats half submerged. The body starts at rest
+	// where the model is, keeping the model's scale. The model must outlive the system. Returns the body's index
+	int AddBody(Model* model, CVector3 halfSize, float density);
+
+	int GetBodyCount() const { return static_cast<int>(mBodies.size()); }
+
+	// Where the bodies make ripples, or nullptr for none (the default). waves must outlive the system and be updated
+	// after it each frame
+	void SetInteractiveWaves(InteractiveWaves* waves);
+
+	// Advances the bodies by frameTime in fixed steps and updates every model's world matrix. At most MAX_STEPS are
+	// taken, so a long stall slows the bodies down rather than making the next frames longer still. Call once per
+	// frame after the grid has been evaluated, or after WaveSimulationThread::Update while one owns the grid
+	void Update(float frameTime);
+
+	// Seconds the last Update took, queries included
+	float LastUpdateTime() const { return mLastUpdateTime; }
+
+
+	static const int PROBES_PER_BODY = 8;
+	const float WATER_DENSITY = 1000.0f;
+	const float GRAVITY = 9.81f;
+
+
+private:
+	struct Body
+	{
+		Model*   model;
+		CVector3 scale;           // The model's own scale, kept in its world matrix
+		CVector3 halfSize;
+		CVector3 position, velocity;
+		CVector3 axes[3];         // Orientation as the rows of a rotation matrix, i.e. the body's x, y and z axes
+		CVector3 angularVelocity;
+		CVector3 previousPosition, previousAxes[3]; // At the step before, to blend between
+		CVector3 inverseInertia;  // About each of the body's own axes
+		float    mass;
+		float    probeVolume;
+		float    probeRadius;     // Of a disc with the area of a probe's share of the hull, seen from above
+	};
+
+	void Step();
+
+	// Probe positions and the surface under them for the current step
+	void PlaceProbes();
+
+	CWaveGrid* mGrid;
+	float      mTimeStep;
+	float      mAccumulator; // Time not yet stepped through
+	float      mLastUpdateTime;
+
+	std::vector<Body> mBodies;
+
+	// PROBES_PER_BODY entries per body, in body order
+	std::vector<float>    mProbeX, mProbeY, mProbeZ;
+	std::vector<float>    mSurfaceHeight;
+	std::vector<CVector3> mWaterVelocity;
+	std::vector<float>    mSubmergedVolume;
+
+	// The water each probe displaced into mWaves at the last step
+	InteractiveWaves*  mWaves;
+	std::vector<float> mImprintX, mImprintZ, mImprintVolume;
+
+	// Limits on the motion, in the same units as the scene
+	static const int MAX_STEPS = 4;
+	const float LINEAR_DRAG = 1.0f;  // Per second, for a fully submerged body moving through the water
+	const float ANGULAR_DRAG = 0.5f; // Per second, likewise for spin
+};
+
+
+#endif //_BUOYANCY_H_INCLUDED_
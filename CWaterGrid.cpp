@@ -1,66 +1,490 @@
 #include "CWaterGrid.h"
 #include "simple_fft\fft_settings.h"
 #include "simple_fft\fft.h"
+#include "simple_fft\fft_plan.hpp"
+#include "CounterRandom.h"
 #include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cfloat>
+#include <climits>
+#include <emmintrin.h>
+#include <fstream>
+#include <cstring>
+
+CWaveGrid::CWaveGrid(const int size, const float phillips, const CVector2 wind, const float length, const uint32_t seed,
+                     const int numCascades, const float cascadeRatio) :
+	mSize(0), mSizePlus1(0), mNumCascades(0), mCascadeRatio(cascadeRatio), mPhillipsParameter(phillips), mWind(wind),
+	mLength(length), mSeed(seed), mWaveTablesStale(false), mTilde0Stale(false), mTilde0Amplitude(0),
+	mFoamTime(-FLT_MAX), mQueryTime(-FLT_MAX), mQuerySource(nullptr), mGerstnerWaveCount(64), mGerstnerStale(true),
+	mKeyframeInterval(1.0f / 30.0f), mBandInterval(0), mBathymetryResolution(0), mOwnThreadPool(new ThreadPool()), mThreadPool(*mOwnThreadPool), mLodParent(nullptr), mLodRequest(0),
+	mMeshSink(nullptr), mVertexSink(nullptr), mInteractiveWaves(nullptr), mBakedFrames(0), mBakedFrameStride(0) {
+	mWaterGridMesh = nullptr;
+	mWaterGridModel = nullptr;
+	SetResolution(size, numCascades);
+}
+
+CWaveGrid::CWaveGrid(CWaveGrid& parent, const int size) :
+	mSize(0), mSizePlus1(0), mNumCascades(0), mCascadeRatio(parent.mCascadeRatio), mPhillipsParameter(parent.mPhillipsParameter),
+	mWind(parent.mWind), mLength(parent.mLength), mSeed(parent.mSeed), mWaveTablesStale(false), mTilde0Stale(false), mTilde0Amplitude(0),
+	mFoamTime(-FLT_MAX), mQueryTime(-FLT_MAX), mQuerySource(nullptr), mGerstnerWaveCount(64), mGerstnerStale(true),
+	mKeyframeInterval(1.0f / 30.0f), mBandInterval(0), mBathymetry(parent.mBathymetry),
+	mBathymetryResolution(parent.mBathymetryResolution), mThreadPool(parent.mThreadPool), mLodParent(&parent), mLodRequest(0),
+	mMeshSink(nullptr), mVertexSink(nullptr), mInteractiveWaves(nullptr), mBakedFrames(0), mBakedFrameStride(0) {
+	mWaterGridMesh = nullptr;
+	mWaterGridModel = nullptr;
+	SetResolution(size, parent.mNumCascades);
+}
+
+// Everything that depends on the size or the number of cascades is rebuilt here, in the buffers' existing memory
+// where ReserveResolution has made room. The Gaussian draws are keyed by each wave's offset from k = 0, so the
+// waves that both resolutions hold keep their h0 and the sea looks much the same after a change.
+void CWaveGrid::SetResolution(const int size, const int numCascades)
+{
+	if (numCascades < 1 || numCascades > MAX_CASCADES) throw std::runtime_error("Wave grid needs 1 to " + std::to_string(MAX_CASCADES) + " cascades");
+	if (numCascades > 1 && mCascadeRatio <= 1.0f) throw std::runtime_error("Wave cascades must grow in length");
+	if (size < MIN_SIZE) throw std::runtime_error("Wave grid needs a size of at least " + std::to_string(MIN_SIZE));
+	if (size == mSize && numCascades == mNumCascades) return;
+
+	const char* error = nullptr;
+	if (size != mSize && !mFFTPlan.init(size, simple_fft::impl::FFT_BACKWARD, error)) throw std::runtime_error(error);
+
+	Mesh* mesh = GridMesh(size);
+	if (mWaterGridModel) mWaterGridModel->SetMesh(mesh);
+	else mWaterGridModel = new Model(mesh);
+	mWaterGridMesh = mesh;
+	MeshVertexSink* meshSink = mMeshSinks[size];
+	if (mVertexSink == mMeshSink) mVertexSink = meshSink;
+	mMeshSink = meshSink;
+
+	if (size != mSize) UnloadBakedAnimation();
+	mSize = size;
+	mSizePlus1 = size + 1;
+	mNumCascades = numCascades;
+
+	// A column transform walks down the rows, and rows an even number of cache lines apart share half the cache
+	// sets or fewer (all of them at multiples of 4KB), so the pitch is padded to an odd number of lines
+	const int lineElements = 64 / sizeof(wave_complex);
+	mSpectrumPitch = FIELD_COUNT * mSize * mNumCascades;
+	if ((mSpectrumPitch / lineElements) % 2 == 0) mSpectrumPitch += lineElements;
+	mSpectrum.resize(mSize * mSpectrumPitch);
 
-CWaveGrid::CWaveGrid(const int size, const float phillips, const CVector2 wind, const float length) :
-	mSize(size), mSizePlus1(size + 1), mPhillipsParameter(phillips), mWind(wind), mLength(length) {
-	mTilde.resize(mSize * mSize);
-	mTildeSlopeX.resize(mSize * mSize);
-	mTildeSlopeZ.resize(mSize * mSize);
-	mTildeDX.resize(mSize * mSize);
-	mTildeDZ.resize(mSize * mSize);
-
-	mWaterGrid = new WaterGridVertex[mSizePlus1 * mSizePlus1];
-	mWaterGridMesh = new Mesh(CVector3(-length, 0, -length), CVector3(length, 0, length), size, size, true, true);
-	mWaterGridModel = new Model(mWaterGridMesh);
 	int i;
-	complex_type tilde, tildeConj;
 
 	//float xStep = (-length - length) / size;
 	//mWaterGrid[i].originalPos.x = mWaterGrid[i].vertex.x = -length + (xStep * gridX); Investigate further to fix scaling issue.
 
+	const int tableSize = mSize * mSize;
+	mRestX.resize(mSizePlus1);
+	mRestZ.resize(mSizePlus1);
+	mCascadeLength.resize(mNumCascades);
+	mWaveNumber.resize(mNumCascades * mSize);
+	mKUnitX.resize(tableSize);
+	mKUnitZ.resize(tableSize);
+	mGaussian.resize(mNumCascades * tableSize);
+	mDispersionStep.resize(mNumCascades * tableSize);
+	mTilde0.resize(mNumCascades * tableSize);
+	mTilde0Conj.resize(mNumCascades * tableSize);
+	UpdateCascadeBands();
+	UpdateWaveTables();
+	UpdateVertexDepths();
+
+	mPositionX.resize(mSizePlus1 * mSizePlus1);
+	mPositionY.assign(mSizePlus1 * mSizePlus1, 0.0f);
+	mPositionZ.resize(mSizePlus1 * mSizePlus1);
+	mNormalX.assign(mSizePlus1 * mSizePlus1, 0.0f);
+	mNormalY.assign(mSizePlus1 * mSizePlus1, 1.0f);
+	mNormalZ.assign(mSizePlus1 * mSizePlus1, 0.0f);
+	mJacobian.assign(mSizePlus1 * mSizePlus1, 1.0f);
+	mFoam.assign(mSizePlus1 * mSizePlus1, 0.0f);
+	mQueryTexels.assign(mSizePlus1 * mSizePlus1, QueryTexel());
 	for (int gridX = 0; gridX < mSizePlus1; gridX++) {
 		for (int gridY = 0; gridY < mSizePlus1; gridY++) {
 			i = gridX * mSizePlus1 + gridY;
-			tilde = Tilde0(gridY, gridX);
-			tildeConj = Tilde0(-gridY, gridX);
-			tildeConj = { tildeConj._Val[0], -tildeConj._Val[1] };
+			mPositionX[i] = mRestX[gridY];
+			mPositionZ[i] = mRestZ[gridX];
+		}
+	}
+
+	// The wave directions and the Gaussian draws behind h0 never change, whatever the wind, amplitude or length,
+	// so they are made once here. Each entry depends only on its own wave vector, so rows can be filled in any
+	// order. Range [begin, end) covers rows of all cascades in turn.
+	auto fillTables = [&](int begin, int end) {
+		int i, cascade, gridY;
+		float kLength;
+		for (int row = begin; row < end; row++) {
+			cascade = row / mSize;
+			gridY = row % mSize;
+			for (int gridX = 0; gridX < mSize; gridX++) {
+				i = gridY * mSize + gridX;
+
+				if (cascade == 0) {
+					kLength = sqrt(mWaveNumber[gridY] * mWaveNumber[gridY] + mWaveNumber[gridX] * mWaveNumber[gridX]);
+					if (kLength < 0.000001f) mKUnitX[i] = mKUnitZ[i] = 0.0f;
+					else {
+						mKUnitX[i] = mWaveNumber[gridY] / kLength;
+						mKUnitZ[i] = mWaveNumber[gridX] / kLength;
+					}
+				}
+
+				float gaussianX, gaussianY;
+				GaussianPair(mSeed + static_cast<uint32_t>(cascade) * 0x9E3779B9u, gridY - mSize / 2, gridX - mSize / 2, gaussianX, gaussianY);
+				mGaussian[cascade * tableSize + i] = wave_complex(gaussianX, gaussianY);
+			}
+		}
+	};
+	mThreadPool.ParallelFor(mNumCascades * mSize, fillTables);
+	UpdateTilde0();
+
+	// A vertex at rest coordinate p falls between samples floor(u) and floor(u) + 1 of a cascade of length L,
+	// u = p * N / L + N / 2, and the coarser cascades repeat, so the indices wrap. Rest positions and cascade
+	// lengths both scale with mLength, so the taps stay the same when it changes.
+	const float signs[] = { 1.0f, -1.0f };
+	mCascadeTaps.resize((mNumCascades - 1) * mSizePlus1);
+	for (int cascade = 1; cascade < mNumCascades; cascade++) {
+		for (int n = 0; n < mSizePlus1; n++) {
+			const float u = mRestX[n] * mSize / mCascadeLength[cascade] + mSize / 2.0f;
+			const float base = floor(u);
+			CascadeTap& tap = mCascadeTaps[(cascade - 1) * mSizePlus1 + n];
+			tap.index0 = ((static_cast<int>(base) % mSize) + mSize) % mSize;
+			tap.index1 = (tap.index0 + 1) % mSize;
+			tap.weight0 = (1.0f - (u - base)) * signs[tap.index0 & 1];
+			tap.weight1 = (u - base) * signs[tap.index1 & 1];
+		}
+	}
+
+	// Nothing from the last frame carries over
+	mFoamTime = -FLT_MAX;
+	mQueryTime = -FLT_MAX;
+	ClearKeyframes();
+	ClearBands();
+	UpdateLods();
+}
+
+// The grid mesh for a size and the sink that writes to it, built the first time they are asked for and kept for later
+// changes of resolution. Vertices are overwritten every frame, so the extent the mesh is built with does not matter
+Mesh* CWaveGrid::GridMesh(const int size)
+{
+	Mesh*& mesh = mGridMeshes[size];
+	if (!mesh) {
+		mesh = new Mesh(CVector3(-mLength, 0, -mLength), CVector3(mLength, 0, mLength), size, size, true, true);
+		mMeshSinks[size] = new MeshVertexSink(mesh);
+	}
+	return mesh;
+}
+
+void CWaveGrid::ReserveResolution(const int minSize, const int maxSize, const int maxCascades)
+{
+	for (int level = 1; level <= static_cast<int>(mLods.size()); level++) {
+		mLods[level - 1]->ReserveResolution(std::max(minSize >> level, MIN_LOD_SIZE), std::max(maxSize >> level, MIN_LOD_SIZE), maxCascades);
+	}
+
+	for (int size = minSize; size <= maxSize; size *= 2) GridMesh(size);
+	mFFTPlan.reserve(maxSize);
+
+	// The fastest wave sits in a corner of the first cascade; a shorter length set later would need more steps
+	const float kMax = sqrt(2.0f) * PI * maxSize / mLength;
+	const int maxStep = static_cast<int>(floor(sqrt(GRAVITY * kMax) * REPEAT_TIME / (2.0f * PI)));
+	mPhaseSteps.reserve(maxStep + 2);
+	for (std::vector<wave_complex>& steps : mBandPhaseSteps) steps.reserve(maxStep + 2);
+
+	const int lineElements = 64 / sizeof(wave_complex);
+	const size_t tableSize = static_cast<size_t>(maxSize) * maxSize;
+	const size_t vertexCount = static_cast<size_t>(maxSize + 1) * (maxSize + 1);
+	mSpectrum.reserve(maxSize * (FIELD_COUNT * maxSize * maxCascades + lineElements));
+	mCascadeLength.reserve(maxCascades);
+	mBandLow.reserve(maxCascades);
+	mBandHigh.reserve(maxCascades);
+	mWaveNumber.reserve(maxCascades * maxSize);
+	mKUnitX.reserve(tableSize);
+	mKUnitZ.reserve(tableSize);
+	mGaussian.reserve(maxCascades * tableSize);
+	mDispersionStep.reserve(maxCascades * tableSize);
+	mTilde0.reserve(maxCascades * tableSize);
+	mTilde0Conj.reserve(maxCascades * tableSize);
+	mRestX.reserve(maxSize + 1);
+	mRestZ.reserve(maxSize + 1);
+	mCascadeTaps.reserve((maxCascades - 1) * (maxSize + 1));
+	for (AlignedVector<float>* vertexArray : { &mPositionX, &mPositionY, &mPositionZ, &mNormalX, &mNormalY, &mNormalZ, &mJacobian, &mFoam }) {
+		vertexArray->reserve(vertexCount);
+	}
+	mQueryTexels.reserve(vertexCount);
+	if (!mBathymetry.empty()) {
+		mVertexDepthBand.reserve(vertexCount);
+		mVertexDepthWeight.reserve(vertexCount);
+		for (DepthBand& band : mDepthBands) {
+			band.dispersionStep.reserve(maxCascades * tableSize);
+			band.spectrum.reserve(mSpectrum.capacity());
+		}
+	}
+	for (int cascade = 1; cascade < maxCascades; cascade++) {
+		for (AlignedVector<wave_complex>& fields : mBands[cascade].fields) fields.reserve(FIELD_COUNT * tableSize);
+	}
+	for (Keyframe& keyframe : mKeyframes) {
+		for (AlignedVector<float>* vertexArray : { &keyframe.positionX, &keyframe.positionY, &keyframe.positionZ, &keyframe.normalX,
+		                                           &keyframe.normalY, &keyframe.normalZ, &keyframe.jacobian, &keyframe.foam }) {
+			vertexArray->reserve(vertexCount);
+		}
+	}
+}
+
+// Cascade c covers wave numbers from its fundamental 2 pi / L up to its Nyquist limit N pi / L. Where two
+// neighbouring cascades overlap they split the range at the geometric midpoint between the finer one's
+// fundamental and the coarser one's limit, so no wave is counted twice. The coarser cascades are interpolated
+// bilinearly between their samples, which stays within a few percent only with 8 or more samples a wavelength,
+// so the split is never above a quarter of the coarser limit. Below 8 * cascadeRatio points that leaves a few
+// waves between the two bands out. Every limit scales with 1 / mLength, so no wave changes band with the length.
+// A level of detail moves the split up to its parent's where it can (see below).
+void CWaveGrid::UpdateCascadeBands()
+{
+	mBandLow.assign(mNumCascades, 0.0f);
+	mBandHigh.assign(mNumCascades, FLT_MAX);
+	for (int cascade = 0; cascade < mNumCascades; cascade++) {
+		mCascadeLength[cascade] = mLength * pow(mCascadeRatio, static_cast<float>(cascade));
+	}
+	for (int cascade = 0; cascade + 1 < mNumCascades; cascade++) {
+		const float fundamental = 2.0f * PI / mCascadeLength[cascade];
+		const float coarserLimit = PI * mSize / mCascadeLength[cascade + 1];
+		mBandLow[cascade] = mBandHigh[cascade + 1] = std::min(sqrt(fundamental * coarserLimit), coarserLimit / 4.0f);
+		// A level of detail keeps its parent's split wherever the coarser cascade has room for it, so that it holds
+		// the same waves, even if they are interpolated less accurately
+		if (mLodParent) mBandLow[cascade] = mBandHigh[cascade + 1] = std::min(mLodParent->mBandLow[cascade], coarserLimit);
+	}
+}
+
+// Everything that depends on the patch length apart from h0: rest positions, wave numbers and frequencies
+void CWaveGrid::UpdateWaveTables()
+{
+	for (int n = 0; n < mSizePlus1; n++) {
+		mRestX[n] = (n - mSize / 2.0f) * mLength / mSize;
+		mRestZ[n] = (n - mSize / 2.0f) * mLength / mSize;
+	}
+	for (int cascade = 0; cascade < mNumCascades; cascade++) {
+		for (int n = 0; n < mSize; n++) mWaveNumber[cascade * mSize + n] = PI * (2 * n - mSize) / mCascadeLength[cascade];
+	}
+
+	const int tableSize = mSize * mSize;
+	auto fillSteps = [&](AlignedVector<int>& steps, float depth) {
+		auto fillRows = [&](int begin, int end) {
+			for (int row = begin; row < end; row++) {
+				const int cascade = row / mSize;
+				const int gridY = row % mSize;
+				for (int gridX = 0; gridX < mSize; gridX++) {
+					steps[cascade * tableSize + gridY * mSize + gridX] = DispersionStep(gridY, gridX, cascade, depth);
+				}
+			}
+		};
+		mThreadPool.ParallelFor(mNumCascades * mSize, fillRows);
+	};
+	fillSteps(mDispersionStep, FLT_MAX);
+
+	// A band only needs solving for the cascades where its depth changes the step of some wave they hold
+	if (!mBathymetry.empty()) {
+		for (int band = 0; band < DEPTH_BANDS; band++) {
+			DepthBand& depthBand = mDepthBands[band];
+			depthBand.dispersionStep.resize(mNumCascades * tableSize);
+			fillSteps(depthBand.dispersionStep, SHALLOWEST_DEPTH * pow(2.0f, static_cast<float>(band)));
+			for (int cascade = 0; cascade < mNumCascades; cascade++) {
+				depthBand.differs[cascade] = false;
+				for (int i = cascade * tableSize; i < (cascade + 1) * tableSize && !depthBand.differs[cascade]; i++) {
+					const int gridY = (i / mSize) % mSize, gridX = i % mSize;
+					depthBand.differs[cascade] = depthBand.dispersionStep[i] != mDispersionStep[i] && gridX != 0 && gridY != 0 &&
+					                             InBand(gridY, gridX, cascade);
+				}
+			}
+		}
+	}
 
-			mWaterGrid[i].tilde.x = tilde._Val[0];
-			mWaterGrid[i].tilde.y = tilde._Val[1];
-			mWaterGrid[i].tildeConj.x = tildeConj._Val[0];
-			mWaterGrid[i].tildeConj.y = tildeConj._Val[1];
+	const int maxStep = *std::max_element(mDispersionStep.begin(), mDispersionStep.end());
+	mPhaseSteps.resize(maxStep + 1);
+	for (std::vector<wave_complex>& steps : mBandPhaseSteps) steps.resize(maxStep + 1);
+	mWaveTablesStale = false;
+}
 
-			mWaterGrid[i].originalPos.x = mWaterGrid[i].vertex.x = (gridY - mSize / 2.0f) * length / mSize;
-			mWaterGrid[i].originalPos.y = mWaterGrid[i].vertex.y = 0.0f;
-			mWaterGrid[i].originalPos.z = mWaterGrid[i].vertex.z = (gridX - mSize / 2.0f) * length / mSize;
+// h0 for every wave from the Gaussian draws and the current spectrum
+void CWaveGrid::UpdateTilde0()
+{
+	const int tableSize = mSize * mSize;
 
-			mWaterGrid[i].normal.x = mWaterGrid[i].normal.z = 0.0f;
-			mWaterGrid[i].normal.y = 1.0f;
+	// The Nyquist lines (index 0, k = -N*pi/L) are their own mirror images on the FFT grid and
+	// cannot hold a Hermitian pair, so they are left empty.
+	auto fillTilde0 = [&](int begin, int end) {
+		for (int row = begin; row < end; row++) {
+			const int cascade = row / mSize;
+			const int gridY = row % mSize;
+			for (int gridX = 0; gridX < mSize; gridX++) {
+				const int i = cascade * tableSize + gridY * mSize + gridX;
+				if (gridX == 0 || gridY == 0 || !InBand(gridY, gridX, cascade)) mTilde0[i] = { 0.0f, 0.0f };
+				else mTilde0[i] = mGaussian[i] * static_cast<wave_real>(sqrt(Phillips(gridY, gridX, cascade) / 2.0f));
+			}
 		}
+	};
+	mThreadPool.ParallelFor(mNumCascades * mSize, fillTilde0);
+
+	// -k sits at the mirrored indices, so conj(h0(-k)) comes from there rather than from a fresh draw.
+	// This makes every spectrum built by Tilde() conjugate-symmetric and its inverse transform real.
+	auto fillConj = [&](int begin, int end) {
+		for (int row = begin; row < end; row++) {
+			const int cascade = row / mSize;
+			const int gridY = row % mSize;
+			for (int gridX = 0; gridX < mSize; gridX++) {
+				const int i = cascade * tableSize + gridY * mSize + gridX;
+				const int partner = cascade * tableSize + ((mSize - gridY) % mSize) * mSize + (mSize - gridX) % mSize;
+				mTilde0Conj[i] = std::conj(mTilde0[partner]);
+			}
+		}
+	};
+	mThreadPool.ParallelFor(mNumCascades * mSize, fillConj);
+
+	mTilde0Amplitude = mPhillipsParameter;
+	mTilde0Stale = false;
+	mGerstnerStale = true;
+}
+
+// The weather setters only note the change, however many come in before the next frame, and ApplySpectrumChanges
+// catches the tables up; the mesh is left alone. Every wave keeps its Gaussian draw, so a new wind or amplitude only
+// changes how big each wave is and the sea morphs from one state to the other rather than being replaced. A new length
+// changes the frequency of every wave as well, so the surface jumps, and a baked animation no longer fits
+void CWaveGrid::SetWind(const CVector2 wind)
+{
+	mWind = wind;
+	mTilde0Stale = true;
+	for (auto& lod : mLods) lod->SetWind(wind);
+}
+
+void CWaveGrid::SetAmplitude(const float phillips)
+{
+	mPhillipsParameter = phillips;
+	for (auto& lod : mLods) lod->SetAmplitude(phillips);
+}
+
+void CWaveGrid::SetLength(const float length)
+{
+	if (length == mLength) return;
+	mLength = length;
+	UpdateCascadeBands();
+	mWaveTablesStale = true;
+	mTilde0Stale = true;
+	UnloadBakedAnimation();
+	for (auto& lod : mLods) lod->SetLength(length);
+}
+
+void CWaveGrid::SetLodCount(int count)
+{
+	mLodRequest = std::max(count, 0);
+	UpdateLods();
+}
+
+// Makes, resizes or drops levels to match the request and the current size. A level keeps its model and meshes
+// through changes of size, as this grid does.
+void CWaveGrid::UpdateLods()
+{
+	int count = 0;
+	while (count < mLodRequest && (mSize >> (count + 1)) >= MIN_LOD_SIZE) count++;
+
+	mLods.resize(count);
+	for (int level = 1; level <= count; level++) {
+		std::unique_ptr<CWaveGrid>& lod = mLods[level - 1];
+		if (lod) lod->SetResolution(mSize >> level, mNumCascades);
+		else lod.reset(new CWaveGrid(*this, mSize >> level));
+	}
+}
+
+void CWaveGrid::WavesEvaluationLods(float t)
+{
+	for (auto& lod : mLods) lod->WavesEvaluationFFT(t);
+}
+
+// Brings the tables up to date with the Set functions before a frame is built. h0 is proportional to the square
+// root of the amplitude, so an amplitude change alone just rescales it; anything else refills it
+void CWaveGrid::ApplySpectrumChanges()
+{
+	if (mWaveTablesStale) {
+		UpdateWaveTables();
+		mQueryTime = -FLT_MAX; // Every wave has moved, so there is no velocity to take from the last frame
+		ClearKeyframes();      // nor anything to blend with
+		ClearBands();
+	}
+	if (mTilde0Stale || (mTilde0Amplitude <= 0.0f && mPhillipsParameter != mTilde0Amplitude)) {
+		UpdateTilde0();
+	}
+	else if (mPhillipsParameter != mTilde0Amplitude) {
+		const wave_real scale = static_cast<wave_real>(sqrt(std::max(mPhillipsParameter, 0.0f) / mTilde0Amplitude));
+		auto scaleTables = [&](int begin, int end) {
+			for (int i = begin * mSize; i < end * mSize; i++) {
+				mTilde0[i] *= scale;
+				mTilde0Conj[i] *= scale;
+			}
+		};
+		mThreadPool.ParallelFor(mNumCascades * mSize, scaleTables);
+		mTilde0Amplitude = mPhillipsParameter;
+		mGerstnerStale = true;
 	}
 }
 
 CWaveGrid::~CWaveGrid()
 {
 	//if (mFft) delete mFft;
-	if (mWaterGrid) delete[] mWaterGrid;
-	if (mWaterGridMesh) delete mWaterGridMesh;
+	for (auto& sink : mMeshSinks) delete sink.second;
+	for (auto& mesh : mGridMeshes) delete mesh.second;
 	if (mWaterGridModel) delete mWaterGridModel;
 }
 
 float CWaveGrid::Dispersion(int gridY, int gridX)
 {
-	float w = 2.0f * PI / 200.0f;
-	float kX = PI * (2 * gridY - mSize) / mLength;
-	float kZ = PI * (2 * gridX - mSize) / mLength;
-	return floor(sqrt(GRAVITY * sqrt(kX * kX + kZ * kZ)) / w) * w;
+	return DispersionStep(gridY, gridX) * 2.0f * PI / REPEAT_TIME;
+}
+
+// Dispersion sqrt(g|k| tanh(|k| depth)), which is sqrt(g|k|) in deep water (depth FLT_MAX), rounded down to a whole
+// number of steps of 2 pi / REPEAT_TIME. Shallower water only ever lowers the step, so mPhaseSteps covers every depth
+int CWaveGrid::DispersionStep(int gridY, int gridX, int cascade, float depth)
+{
+	float w = 2.0f * PI / REPEAT_TIME;
+	float kX = PI * (2 * gridY - mSize) / mCascadeLength[cascade];
+	float kZ = PI * (2 * gridX - mSize) / mCascadeLength[cascade];
+	float kLength = sqrt(kX * kX + kZ * kZ);
+	float shoaling = depth < FLT_MAX ? tanh(kLength * depth) : 1.0f;
+	return static_cast<int>(floor(sqrt(GRAVITY * kLength * shoaling) / w));
+}
+
+// Since every frequency is a multiple m of the base step, exp(i omega t) for all k is a power of one rotor.
+// The powers are built by complex multiplication in double, starting again from an exact sincos every
+// few dozen steps so rounding cannot build up. Time is wrapped to the repeat period first, which keeps the
+// phase accurate however long the simulation has been running.
+void CWaveGrid::UpdatePhaseSteps(float t, std::vector<wave_complex>& steps)
+{
+	const int reseedInterval = 64;
+	const double angle = 2.0 * PI * fmod(static_cast<double>(t), static_cast<double>(REPEAT_TIME)) / REPEAT_TIME;
+	const std::complex<double> rotor(cos(angle), sin(angle));
+	std::complex<double> phase;
+
+	for (int m = 0; m < static_cast<int>(steps.size()); m++) {
+		if (m % reseedInterval == 0) phase = std::complex<double>(cos(m * angle), sin(m * angle));
+		else phase *= rotor;
+		steps[m] = wave_complex(static_cast<wave_real>(phase.real()), static_cast<wave_real>(phase.imag()));
+	}
 }
 
 float CWaveGrid::Phillips(int gridY, int gridX)
 {
-	CVector2 k = CVector2(PI * (2 * gridY - mSize) / mLength, PI * (2 * gridX - mSize) / mLength);
+	return InBand(gridY, gridX, 0) ? Phillips(gridY, gridX, 0) : 0.0f;
+}
+
+// Whether wave (gridY, gridX) of a cascade lies in the band it is responsible for
+bool CWaveGrid::InBand(int gridY, int gridX, int cascade)
+{
+	const float kX = PI * (2 * gridY - mSize) / mCascadeLength[cascade];
+	const float kZ = PI * (2 * gridX - mSize) / mCascadeLength[cascade];
+	const float kLength = sqrt(kX * kX + kZ * kZ);
+	return kLength >= mBandLow[cascade] && kLength < mBandHigh[cascade];
+}
+
+// The spectrum is defined per wave of the grid, so a patch with more waves per unit of k needs less energy in each:
+// cascades longer than mLength are scaled by (mLength / L)^2, keeping the energy per unit area of k the same.
+float CWaveGrid::Phillips(int gridY, int gridX, int cascade)
+{
+	const float cascadeLength = mCascadeLength[cascade];
+	CVector2 k = CVector2(PI * (2 * gridY - mSize) / cascadeLength, PI * (2 * gridX - mSize) / cascadeLength);
 	float kLength = sqrt(k.x * k.x + k.y * k.y);
 	if (kLength < 0.000001f) return 0.0f;
 	float kLengthSquared = kLength * kLength;
@@ -77,38 +501,38 @@ float CWaveGrid::Phillips(int gridY, int gridX)
 
 	const float damping = 0.001;
 	float lSquaredDamped = lSquared * damping * damping;
-	return  mPhillipsParameter * exp(-1.0f / (kLengthSquared * lSquared)) / kLengthQuadrupled * kDotWSquared * exp(-kLengthSquared * lSquaredDamped);
+	float densityScale = (mLength / cascadeLength) * (mLength / cascadeLength);
+	return  densityScale * mPhillipsParameter * exp(-1.0f / (kLengthSquared * lSquared)) / kLengthQuadrupled * kDotWSquared * exp(-kLengthSquared * lSquaredDamped);
 }
 
-complex_type CWaveGrid::Tilde0(int gridY, int gridX)
+// h0(k) for one wave vector. The Gaussian pair comes from a counter-based generator keyed by the seed and by the
+// wave vector's offset from k = 0, so it is the same whatever order or thread it is drawn in, and a given wave
+// keeps its draw whatever the grid size. Each cascade draws from its own stream, the first from the seed itself.
+wave_complex CWaveGrid::Tilde0(int gridY, int gridX)
 {
-	complex_type gaussianRandom;
-	float x, y, z;
-	do {
-		x = 2.0f * (float)rand() / RAND_MAX - 1.0f;
-		y = 2.0f * (float)rand() / RAND_MAX - 1.0f;
-		z = x * x + y * y;
-	} while (z >= 1.0f);
-	z = sqrt((-2.0f * log(z)) / z);
-	gaussianRandom = { x * z, y * z };
-	float phillipsSqrt = sqrt(Phillips(gridY, gridX) / 2.0f);
-	return { gaussianRandom._Val[0] * phillipsSqrt, gaussianRandom._Val[1] * phillipsSqrt };
+	return InBand(gridY, gridX, 0) ? Tilde0(gridY, gridX, 0) : wave_complex(0.0f, 0.0f);
 }
 
-complex_type CWaveGrid::Tilde(float t, int gridY, int gridX)
+wave_complex CWaveGrid::Tilde0(int gridY, int gridX, int cascade)
 {
-	int i = gridX * mSizePlus1 + gridY;
-	complex_type tilde(mWaterGrid[i].tilde.x, mWaterGrid[i].tilde.y);
-	complex_type tildeConj(mWaterGrid[i].tildeConj.x, mWaterGrid[i].tildeConj.y);
+	float gaussianX, gaussianY;
+	GaussianPair(mSeed + static_cast<uint32_t>(cascade) * 0x9E3779B9u, gridY - mSize / 2, gridX - mSize / 2, gaussianX, gaussianY);
+	float phillipsSqrt = sqrt(Phillips(gridY, gridX, cascade) / 2.0f);
+	return { gaussianX * phillipsSqrt, gaussianY * phillipsSqrt };
+}
 
-	float dispersedT = Dispersion(gridY, gridX) * t;
+wave_complex CWaveGrid::Tilde(float t, int gridY, int gridX)
+{
+	int i = gridY * mSize + gridX;
+
+	float dispersedT = mDispersionStep[i] * 2.0f * PI / REPEAT_TIME * t;
 	float cosDispersedT = cos(dispersedT);
 	float sinDispersedT = sin(dispersedT);
 
-	complex_type tildeMult = { cosDispersedT, sinDispersedT };
-	complex_type tildeMultConj = { cosDispersedT, -sinDispersedT };
+	wave_complex tildeMult = { cosDispersedT, sinDispersedT };
+	wave_complex tildeMultConj = { cosDispersedT, -sinDispersedT };
 
-	complex_type res = Mult(tilde, tildeMult) + Mult(tildeConj, tildeMultConj);
+	wave_complex res = Mult(mTilde0[i], tildeMult) + Mult(mTilde0Conj[i], tildeMultConj);
 
 	return res;
 }
@@ -116,7 +540,7 @@ complex_type CWaveGrid::Tilde(float t, int gridY, int gridX)
 WaterGridNode CWaveGrid::HDN(CVector2 x, float t)
 {
 	WaterGridNode tempNode;
-	complex_type c, res, tildeC, k;
+	wave_complex c, res, tildeC, k;
 	float kX, kY, kLength, kDotX;
 
 	for (int gridX = 0; gridX < mSize; gridX++) {
@@ -141,174 +565,1277 @@ WaterGridNode CWaveGrid::HDN(CVector2 x, float t)
 	return tempNode;
 }
 
-void CWaveGrid::WavesEvaluationFFT(float t)
+// Fills mSpectrum with the fields of count cascades, cascades[n] at times[n], and transforms them. The fields of
+// the other cascades are left as they were. dispersionStep is mDispersionStep or a depth band's.
+void CWaveGrid::SolveCascades(int count, const int* cascades, const float* times, const AlignedVector<int>& dispersionStep)
 {
-	std::vector<CVector3> vertexPositions;
-	std::vector<CVector3> vertexNormals;
+	const float signs[] = { 1.0f, -1.0f };
 
-	float kX, kY, len, lambda = -1.0f;
-	int i, j;
+	// The Nyquist lines hold no waves (see UpdateTilde0); they still have to be cleared of last frame's result.
+	for (int n = 0; n < count; n++) {
+		wave_complex* first = &mSpectrum[cascades[n] * FIELD_COUNT * mSize];
+		std::fill(first, first + FIELD_COUNT * mSize, wave_complex(0.0f, 0.0f));
+		for (int gridY = 1; gridY < mSize; gridY++) {
+			wave_complex* row = &mSpectrum[gridY * mSpectrumPitch + cascades[n] * FIELD_COUNT * mSize];
+			for (int field = 0; field < FIELD_COUNT; field++) row[field * mSize] = { 0.0f, 0.0f };
+		}
+	}
 
-	for (int gridX = 0; gridX < mSize; gridX++) {
-		kY = PI * (2.0f * gridX - mSize) / mLength;
-		for (int gridY = 0; gridY < mSize; gridY++) {
-			kX = PI * (2.0f * gridY - mSize) / mLength;
-			len = sqrt(kX * kX + kY * kY);
-			i = gridX * mSize + gridY;
+	// The time dependence exp(i omega t) comes from a table of phase steps for each different time, so no
+	// trigonometry is done per wave vector.
+	const wave_complex* phaseSteps[MAX_CASCADES];
+	for (int n = 0; n < count; n++) {
+		phaseSteps[n] = nullptr;
+		for (int other = 0; other < n && !phaseSteps[n]; other++) {
+			if (times[other] == times[n]) phaseSteps[n] = phaseSteps[other];
+		}
+		if (!phaseSteps[n]) {
+			std::vector<wave_complex>& steps = n == 0 ? mPhaseSteps : mBandPhaseSteps[n];
+			UpdatePhaseSteps(times[n], steps);
+			phaseSteps[n] = steps.data();
+		}
+	}
+
+	// The grid indices run from -N/2 so both the spectrum and the result pick up a (-1)^(n+m) factor
+	// relative to a plain DFT. Applying it to the input here keeps the surface aligned with HDN.
+	// Every field is Hermitian, so only half of the wave vectors are evaluated: where the packed value at k is
+	// A + i*B, the one at the mirrored index -k is conj(A) + i*conj(B), with the same sign factor.
+	// Range [begin, end) covers rows 1 .. N/2 of the lower half of each cascade solved in turn, plus their mirrors.
+	auto buildSpectrum = [&](int begin, int end) {
+		float kX, kY, sign;
+		int i, mirrorX, item, cascade, gridY;
+		wave_complex phase, tilde, slopeX, slopeZ, dX, dZ, dXdX, dZdZ, dXdZ;
+		const wave_complex imaginary(0.0f, 1.0f);
+
+		for (int range = begin; range < end; range++) {
+			item = range / (mSize / 2);
+			cascade = cascades[item];
+			gridY = range % (mSize / 2) + 1;
+			const float* waveNumber = &mWaveNumber[cascade * mSize];
+			kX = waveNumber[gridY];
+			wave_complex* row = &mSpectrum[gridY * mSpectrumPitch + cascade * FIELD_COUNT * mSize];
+			wave_complex* mirrorRow = &mSpectrum[(mSize - gridY) * mSpectrumPitch + cascade * FIELD_COUNT * mSize];
+			// on the middle row the mirror runs along the row itself, so only its second half is needed
+			for (int gridX = (gridY == mSize / 2 ? mSize / 2 : 1); gridX < mSize; gridX++) {
+				i = gridY * mSize + gridX;
+				kY = waveNumber[gridX];
+				sign = signs[(gridY + gridX) & 1];
+				mirrorX = mSize - gridX;
 
-			mTilde[i] = Tilde(t, gridY, gridX);
-			mTildeSlopeX[i] = Mult(mTilde[i], complex_type(0.0f, kX));
-			mTildeSlopeZ[i] = Mult(mTilde[i], complex_type(0.0f, kY));
+				const int table = i + cascade * mSize * mSize;
+				phase = phaseSteps[item][dispersionStep[table]];
+				tilde = (Mult(mTilde0[table], phase) + Mult(mTilde0Conj[table], std::conj(phase))) * (wave_real)sign;
+				slopeX = Mult(tilde, wave_complex(0.0f, kX));
+				slopeZ = Mult(tilde, wave_complex(0.0f, kY));
+				dX = Mult(tilde, wave_complex(0.0f, -mKUnitX[i]));
+				dZ = Mult(tilde, wave_complex(0.0f, -mKUnitZ[i]));
+				// the derivatives of the displacement multiply it by i k along the axis, leaving real factors
+				dXdX = tilde * (wave_real)(kX * mKUnitX[i]);
+				dZdZ = tilde * (wave_real)(kY * mKUnitZ[i]);
+				dXdZ = tilde * (wave_real)(kY * mKUnitX[i]);
 
-			if (len < 0.000001f) {
-				mTildeDX[i] = { 0.0f, 0.0f };
-				mTildeDZ[i] = { 0.0f, 0.0f };
+				row[FIELD_HEIGHT_SLOPE_X * mSize + gridX] = tilde + Mult(slopeX, imaginary);
+				row[FIELD_SLOPE_Z_DX * mSize + gridX] = slopeZ + Mult(dX, imaginary);
+				row[FIELD_DZ_DXDX * mSize + gridX] = dZ + Mult(dXdX, imaginary);
+				row[FIELD_DZDZ_DXDZ * mSize + gridX] = dZdZ + Mult(dXdZ, imaginary);
+
+				mirrorRow[FIELD_HEIGHT_SLOPE_X * mSize + mirrorX] = std::conj(tilde) + Mult(std::conj(slopeX), imaginary);
+				mirrorRow[FIELD_SLOPE_Z_DX * mSize + mirrorX] = std::conj(slopeZ) + Mult(std::conj(dX), imaginary);
+				mirrorRow[FIELD_DZ_DXDX * mSize + mirrorX] = std::conj(dZ) + Mult(std::conj(dXdX), imaginary);
+				mirrorRow[FIELD_DZDZ_DXDZ * mSize + mirrorX] = std::conj(dZdZ) + Mult(std::conj(dXdZ), imaginary);
 			}
-			else {
-				mTildeDX[i] = Mult(mTilde[i], complex_type(0.0f, -kX / len));
-				mTildeDZ[i] = Mult(mTilde[i], complex_type(0.0f, -kY / len));
+		}
+	};
+	mThreadPool.ParallelFor(count * (mSize / 2), buildSpectrum);
+
+	InverseFFT2DFields(count, cascades);
+}
+
+// Every stage is split over rows (or column blocks) between the threads of mThreadPool. Each index is written by
+// exactly one range, so the result does not depend on the number of threads.
+void CWaveGrid::WavesEvaluationFFT(float t)
+{
+	const float signs[] = { 1.0f, -1.0f };
+	ApplySpectrumChanges();
+
+	// Every cascade is solved for t, unless the coarser ones are staggered
+	int cascades[MAX_CASCADES];
+	float times[MAX_CASCADES];
+	int count = 0;
+	const bool staggered = mBandInterval > 0.0f && mNumCascades > 1;
+	if (staggered) count = StaggerBands(t, cascades, times);
+	else {
+		for (int cascade = 0; cascade < mNumCascades; cascade++) {
+			cascades[count] = cascade;
+			times[count++] = t;
+		}
+	}
+	SolveCascades(count, cascades, times, mDispersionStep);
+
+	if (staggered) {
+		for (int n = 1; n < count; n++) StoreBand(cascades[n], 1);
+		for (int cascade = 1; cascade < mNumCascades; cascade++) BlendBand(cascade, t);
+	}
+	const bool shallow = !mBathymetry.empty();
+	if (shallow) SolveDepthBands(t);
+
+	// Each vertex row reads one row of each field and writes one row of each vertex array, all contiguous, then
+	// passes the finished row on to the sink while it is still in cache. The first cascade repeats with the grid,
+	// so the last row and column read its first ones; coarser cascades do not, and are sampled where the vertex is.
+	WaterGridVertex* vertices = mVertexSink->Begin(mSizePlus1 * mSizePlus1);
+
+	float foamFade, inverseTimeStep;
+	AdvanceFrameTime(t, foamFade, inverseTimeStep);
+
+	auto resolveRows = [&](int begin, int end) {
+		float sign;
+		SurfaceSample sample;
+		int gridX, gridY;
+
+		for (int row = begin; row < end; row++) {
+			gridX = row < mSize ? row : 0;
+			const wave_complex* heightSlopeX = &mSpectrum[gridX * mSpectrumPitch + FIELD_HEIGHT_SLOPE_X * mSize];
+			const wave_complex* slopeZDX = &mSpectrum[gridX * mSpectrumPitch + FIELD_SLOPE_Z_DX * mSize];
+			const wave_complex* dZDXDX = &mSpectrum[gridX * mSpectrumPitch + FIELD_DZ_DXDX * mSize];
+			const wave_complex* dZDZDXDZ = &mSpectrum[gridX * mSpectrumPitch + FIELD_DZDZ_DXDZ * mSize];
+
+			for (int column = 0; column < mSizePlus1; column++) {
+				if (shallow) {
+					const int j = row * mSizePlus1 + column;
+					const float weight = mVertexDepthWeight[j];
+					sample = SurfaceSample();
+					AddDepthBand(mVertexDepthBand[j], 1.0f - weight, row, column, sample);
+					if (weight > 0.0f) AddDepthBand(mVertexDepthBand[j] + 1, weight, row, column, sample);
+					ResolveVertex(row, column, sample, foamFade, inverseTimeStep);
+					continue;
+				}
+
+				gridY = column < mSize ? column : 0;
+				sign = signs[(gridY + gridX) & 1];
+
+				sample.height = heightSlopeX[gridY]._Val[0] * sign;
+				sample.slopeX = heightSlopeX[gridY]._Val[1] * sign;
+				sample.slopeZ = slopeZDX[gridY]._Val[0] * sign;
+				sample.dX = slopeZDX[gridY]._Val[1] * sign;
+				sample.dZ = dZDXDX[gridY]._Val[0] * sign;
+				sample.dXdX = dZDXDX[gridY]._Val[1] * sign;
+				sample.dZdZ = dZDZDXDZ[gridY]._Val[0] * sign;
+				sample.dXdZ = dZDZDXDZ[gridY]._Val[1] * sign;
+				for (int cascade = 1; cascade < mNumCascades; cascade++) {
+					AddCascade(mSpectrum, cascade, row, column, 1.0f, sample);
+				}
+				ResolveVertex(row, column, sample, foamFade, inverseTimeStep);
 			}
+
+			EmitRow(vertices, row);
 		}
+	};
+	mThreadPool.ParallelFor(mSizePlus1, resolveRows);
+
+	mVertexSink->End();
+}
+
+void CWaveGrid::SetGerstnerWaveCount(int numWaves)
+{
+	mGerstnerWaveCount = std::max(numWaves, 1);
+	mGerstnerStale = true;
+}
+
+// Ranks every wave of every cascade by |h0|^2 and keeps the mGerstnerWaveCount largest. Waves with no energy
+// (outside their band, on the Nyquist lines, at k = 0) are never kept, so asking for more than there are keeps all.
+void CWaveGrid::SelectGerstnerWaves()
+{
+	const int tableSize = mSize * mSize;
+	std::vector<int> waves;
+	waves.reserve(mNumCascades * tableSize);
+	for (int i = 0; i < mNumCascades * tableSize; i++) {
+		if (std::norm(mTilde0[i]) > 0.0f) waves.push_back(i);
 	}
-	const char* a;
-	bool test;
-	//for (int gridX = 0; gridX < mSize; gridX++) {
-		test = simple_fft::FFT(mTilde, mTilde, size_t(mSize * mSize), a);
-		test = simple_fft::FFT(mTildeSlopeX, mTildeSlopeX, size_t(mSize * mSize), a);
-		test = simple_fft::FFT(mTildeSlopeZ, mTildeSlopeZ, size_t(mSize * mSize), a);
-		test = simple_fft::FFT(mTildeDX, mTildeDX, size_t(mSize * mSize), a);
-		test = simple_fft::FFT(mTildeDZ, mTildeDZ, size_t(mSize * mSize), a);
-	//}
-
-	//for (int gridY = 0; gridY < mSize; gridY++) {
-	//	test = simple_fft::FFT(mTilde, mTilde, size_t(mSize * mSize), a);
-	//	test = simple_fft::FFT(mTildeSlopeX, mTildeSlopeX, size_t(mSize * mSize), a);
-	//	test = simple_fft::FFT(mTildeSlopeZ, mTildeSlopeZ, size_t(mSize * mSize), a);
-	//	test = simple_fft::FFT(mTildeDX, mTildeDX, size_t(mSize * mSize), a);
-	//	test = simple_fft::FFT(mTildeDZ, mTildeDZ, size_t(mSize * mSize), a);
-	//}
-
-	int sign;
-	float signs[] = { 1.0f, -1.0f };
-	CVector3 n;
-	
-	for (int gridX = 0; gridX < mSize; gridX++) {
-		for (int gridY = 0; gridY < mSize; gridY++) {
-			i = gridX * mSize + gridY;
-			j = gridX * mSizePlus1 + gridY;
+	auto larger = [&](int a, int b) {
+		const wave_real energyA = std::norm(mTilde0[a]), energyB = std::norm(mTilde0[b]);
+		return energyA > energyB || (energyA == energyB && a < b);
+	};
+	const int count = std::min(mGerstnerWaveCount, static_cast<int>(waves.size()));
+	std::partial_sort(waves.begin(), waves.begin() + count, waves.end(), larger);
+
+	const int padded = (count + 3) & ~3;
+	GerstnerWaves& g = mGerstner;
+	for (AlignedVector<float>* table : { &g.amplitudeRe, &g.amplitudeIm, &g.kX, &g.kZ, &g.unitX, &g.unitZ,
+	                                     &g.kXUnitX, &g.kZUnitZ, &g.kZUnitX, &g.stepIm, &g.rowStepIm }) {
+		table->assign(padded, 0.0f);
+	}
+	g.stepRe.assign(padded, 1.0f);
+	g.rowStepRe.assign(padded, 1.0f);
+	g.dispersionStep.assign(padded, 0);
+	g.baseRe.resize(padded);
+	g.baseIm.resize(padded);
+	g.scratch.resize(4 * padded * mThreadPool.GetMaxThreadCount());
 
-			sign = signs[(gridY + gridX) & 1];
+	const float spacing = mLength / mSize;
+	for (int n = 0; n < count; n++) {
+		const int table = waves[n];
+		const int cascade = table / tableSize;
+		const int i = table % tableSize;
+		const float kX = mWaveNumber[cascade * mSize + i / mSize];
+		const float kZ = mWaveNumber[cascade * mSize + i % mSize];
+		g.amplitudeRe[n] = 2.0f * static_cast<float>(mTilde0[table].real());
+		g.amplitudeIm[n] = 2.0f * static_cast<float>(mTilde0[table].imag());
+		g.kX[n] = kX;
+		g.kZ[n] = kZ;
+		g.unitX[n] = mKUnitX[i];
+		g.unitZ[n] = mKUnitZ[i];
+		g.kXUnitX[n] = kX * mKUnitX[i];
+		g.kZUnitZ[n] = kZ * mKUnitZ[i];
+		g.kZUnitX[n] = kZ * mKUnitX[i];
+		g.stepRe[n] = cos(kX * spacing);
+		g.stepIm[n] = sin(kX * spacing);
+		g.rowStepRe[n] = cos(kZ * spacing);
+		g.rowStepIm[n] = sin(kZ * spacing);
+		g.dispersionStep[n] = mDispersionStep[table];
+	}
+	mGerstnerStale = false;
+}
 
-			mTilde[i] *= sign;
-			mWaterGrid[i].vertex.y = mTilde[i]._Val[0];
+// Every wave's phase exp(i (k.x + omega t)) is found once per range of rows with sin and cos, then moved on from
+// vertex to vertex and row to row by complex multiplication with its fixed step, which over a few hundred steps
+// loses no more than a few units in the last place. Each vertex then sums four waves per SSE operation, and the
+// fields are passed through the same ResolveVertex as the FFT.
+void CWaveGrid::WavesEvaluationGerstner(float t)
+{
+	ApplySpectrumChanges();
+	if (mGerstnerStale) SelectGerstnerWaves();
+	UpdatePhaseSteps(t, mPhaseSteps);
 
-			mTildeDX[i] *= sign;
-			mTildeDZ[i] *= sign;
-			mWaterGrid[i].vertex.x = mWaterGrid[i].originalPos.x + mTildeDX[i]._Val[0] * lambda;
-			mWaterGrid[i].vertex.z = mWaterGrid[i].originalPos.z + mTildeDZ[i]._Val[0] * lambda;
+	const GerstnerWaves& g = mGerstner;
+	const int count = static_cast<int>(g.amplitudeRe.size());
 
-			mTildeSlopeX[i] *= sign;
-			mTildeSlopeZ[i] *= sign;
-			n = Normalise(CVector3( 0.0f - mTildeSlopeX[i]._Val[0], 1.0f, 0.0f - mTildeSlopeZ[i]._Val[0] ));
-			mWaterGrid[i].normal = n;
+	// 2 h0 exp(i omega t), the wave at x = 0 this frame
+	float* const baseRe = mGerstner.baseRe.data();
+	float* const baseIm = mGerstner.baseIm.data();
+	for (int n = 0; n < count; n++) {
+		const wave_complex phase = mPhaseSteps[g.dispersionStep[n]];
+		baseRe[n] = g.amplitudeRe[n] * static_cast<float>(phase.real()) - g.amplitudeIm[n] * static_cast<float>(phase.imag());
+		baseIm[n] = g.amplitudeRe[n] * static_cast<float>(phase.imag()) + g.amplitudeIm[n] * static_cast<float>(phase.real());
+	}
+
+	WaterGridVertex* vertices = mVertexSink->Begin(mSizePlus1 * mSizePlus1);
+	float foamFade, inverseTimeStep;
+	AdvanceFrameTime(t, foamFade, inverseTimeStep);
+
+	// The rows are split into one range per thread, each with its own four rows of scratch for the phases
+	const int numRanges = std::min(static_cast<int>(mThreadPool.GetThreadCount()), mSizePlus1);
+	auto sumRows = [&](int range) {
+		const int begin = mSizePlus1 * range / numRanges, end = mSizePlus1 * (range + 1) / numRanges;
+		float* const rowRe = mGerstner.scratch.data() + 4 * count * range;
+		float* const rowIm = rowRe + count;
+		float* const re = rowIm + count;
+		float* const im = re + count;
+		alignas(16) float sums[8];
+		SurfaceSample sample;
+
+		for (int n = 0; n < count; n++) {
+			const float angle = g.kX[n] * mRestX[0] + g.kZ[n] * mRestZ[begin];
+			const float c = cos(angle), s = sin(angle);
+			rowRe[n] = baseRe[n] * c - baseIm[n] * s;
+			rowIm[n] = baseRe[n] * s + baseIm[n] * c;
+		}
+
+		for (int row = begin; row < end; row++) {
+			std::copy(rowRe, rowRe + count, re);
+			std::copy(rowIm, rowIm + count, im);
+
+			for (int column = 0; column < mSizePlus1; column++) {
+				__m128 height = _mm_setzero_ps(), slopeX = _mm_setzero_ps(), slopeZ = _mm_setzero_ps();
+				__m128 dX = _mm_setzero_ps(), dZ = _mm_setzero_ps();
+				__m128 dXdX = _mm_setzero_ps(), dZdZ = _mm_setzero_ps(), dXdZ = _mm_setzero_ps();
+				for (int n = 0; n < count; n += 4) {
+					const __m128 waveRe = _mm_load_ps(&re[n]);
+					const __m128 waveIm = _mm_load_ps(&im[n]);
+					height = _mm_add_ps(height, waveRe);
+					slopeX = _mm_sub_ps(slopeX, _mm_mul_ps(_mm_load_ps(&g.kX[n]), waveIm));
+					slopeZ = _mm_sub_ps(slopeZ, _mm_mul_ps(_mm_load_ps(&g.kZ[n]), waveIm));
+					dX = _mm_add_ps(dX, _mm_mul_ps(_mm_load_ps(&g.unitX[n]), waveIm));
+					dZ = _mm_add_ps(dZ, _mm_mul_ps(_mm_load_ps(&g.unitZ[n]), waveIm));
+					dXdX = _mm_add_ps(dXdX, _mm_mul_ps(_mm_load_ps(&g.kXUnitX[n]), waveRe));
+					dZdZ = _mm_add_ps(dZdZ, _mm_mul_ps(_mm_load_ps(&g.kZUnitZ[n]), waveRe));
+					dXdZ = _mm_add_ps(dXdZ, _mm_mul_ps(_mm_load_ps(&g.kZUnitX[n]), waveRe));
+
+					const __m128 stepRe = _mm_load_ps(&g.stepRe[n]);
+					const __m128 stepIm = _mm_load_ps(&g.stepIm[n]);
+					_mm_store_ps(&re[n], _mm_sub_ps(_mm_mul_ps(waveRe, stepRe), _mm_mul_ps(waveIm, stepIm)));
+					_mm_store_ps(&im[n], _mm_add_ps(_mm_mul_ps(waveRe, stepIm), _mm_mul_ps(waveIm, stepRe)));
+				}
+
+				// Transposing each group of four sums puts one field's lanes in each column, so adding the rows
+				// gives all four totals at once
+				_MM_TRANSPOSE4_PS(height, slopeX, slopeZ, dX);
+				_mm_store_ps(sums, _mm_add_ps(_mm_add_ps(height, slopeX), _mm_add_ps(slopeZ, dX)));
+				_MM_TRANSPOSE4_PS(dZ, dXdX, dZdZ, dXdZ);
+				_mm_store_ps(sums + 4, _mm_add_ps(_mm_add_ps(dZ, dXdX), _mm_add_ps(dZdZ, dXdZ)));
+
+				sample.height = sums[0];
+				sample.slopeX = sums[1];
+				sample.slopeZ = sums[2];
+				sample.dX = sums[3];
+				sample.dZ = sums[4];
+				sample.dXdX = sums[5];
+				sample.dZdZ = sums[6];
+				sample.dXdZ = sums[7];
+				ResolveVertex(row, column, sample, foamFade, inverseTimeStep);
+			}
+			EmitRow(vertices, row);
 
-			if (gridX == 0 && gridY == 0) {
-				mWaterGrid[j + mSize + mSizePlus1 * mSize].vertex.y = mTilde[i]._Val[0];
-				mWaterGrid[j + mSize + mSizePlus1 * mSize].vertex.x = mWaterGrid[j + mSize + mSizePlus1 * mSize].originalPos.x + mTildeDX[i]._Val[0] * lambda;
-				mWaterGrid[j + mSize + mSizePlus1 * mSize].vertex.z = mWaterGrid[j + mSize + mSizePlus1 * mSize].originalPos.z + mTildeDZ[i]._Val[0] * lambda;
-				mWaterGrid[j + mSize + mSizePlus1 * mSize].normal = n;
+			for (int n = 0; n < count; n++) {
+				const float nextRe = rowRe[n] * g.rowStepRe[n] - rowIm[n] * g.rowStepIm[n];
+				rowIm[n] = rowRe[n] * g.rowStepIm[n] + rowIm[n] * g.rowStepRe[n];
+				rowRe[n] = nextRe;
 			}
+		}
+	};
+	auto sumRanges = [&](int begin, int end) {
+		for (int range = begin; range < end; range++) sumRows(range);
+	};
+	mThreadPool.ParallelFor(numRanges, sumRanges);
+
+	mVertexSink->End();
+}
+
+// The coarser cascades hold only longer waves, which move more slowly (omega grows as the square root of k), so the
+// second is transformed refreshesPerSecond times a second and each one after it sqrt(cascadeRatio) times less often.
+// A staggered cascade keeps its solves either side of the frame and blends them linearly, so the long waves move on
+// smoothly rather than in steps, and the cascades' refreshes are offset so that they seldom fall in the same frame.
+// Wind and amplitude changes reach them at their next refreshes. BakeAnimation always transforms every cascade
+void CWaveGrid::SetBandRefreshRate(float refreshesPerSecond)
+{
+	const float interval = refreshesPerSecond > 0.0f ? 1.0f / refreshesPerSecond : 0.0f;
+	if (interval == mBandInterval) return;
+	mBandInterval = interval;
+	ClearBands();
+}
+
+void CWaveGrid::ClearBands()
+{
+	for (Band& band : mBands) band.index[0] = band.index[1] = INT_MIN;
+}
+
+// Each coarser cascade needs its solves at the band times either side of t. Moving on by one interval keeps the
+// later solve and needs one more; anything else (the first frame, a jump in time, a new resolution or length)
+// needs both, and the earlier ones are solved in a pass of their own here. Returns the cascades to solve in the
+// frame's own pass - the first for t, then the coarser ones' later solves - and their times.
+int CWaveGrid::StaggerBands(float t, int* cascades, float* times)
+{
+	int earlier[MAX_CASCADES];
+	float earlierTimes[MAX_CASCADES];
+	int numEarlier = 0, count = 0;
+
+	cascades[count] = 0;
+	times[count++] = t;
+	for (int cascade = 1; cascade < mNumCascades; cascade++) {
+		Band& band = mBands[cascade];
+		const int index = static_cast<int>(floor((t - BandTime(cascade, 0)) / BandInterval(cascade)));
+		if (band.index[0] == index && band.index[1] == index + 1) continue;
+
+		if (band.index[1] == index) std::swap(band.fields[0], band.fields[1]);
+		else {
+			earlier[numEarlier] = cascade;
+			earlierTimes[numEarlier++] = BandTime(cascade, index);
+		}
+		band.index[0] = index;
+		band.index[1] = index + 1;
+		cascades[count] = cascade;
+		times[count++] = BandTime(cascade, index + 1);
+	}
+
+	if (numEarlier > 0) {
+		SolveCascades(numEarlier, earlier, earlierTimes, mDispersionStep);
+		for (int n = 0; n < numEarlier; n++) StoreBand(earlier[n], 0);
+	}
+	return count;
+}
+
+// Copies a cascade's transformed fields out of mSpectrum into one of its band's solves
+void CWaveGrid::StoreBand(int cascade, int slot)
+{
+	AlignedVector<wave_complex>& fields = mBands[cascade].fields[slot];
+	const int pitch = FIELD_COUNT * mSize;
+	fields.resize(mSize * pitch);
+	auto copyRows = [&](int begin, int end) {
+		for (int row = begin; row < end; row++) {
+			const wave_complex* source = &mSpectrum[row * mSpectrumPitch + cascade * pitch];
+			std::copy(source, source + pitch, &fields[row * pitch]);
+		}
+	};
+	mThreadPool.ParallelFor(mSize, copyRows);
+}
+
+// Blends a coarser cascade's two solves, linearly by where t falls between them, into its part of mSpectrum for
+// AddCascade. The vertices only cover 1 / cascadeRatio of the coarser patch along each axis, so only the samples
+// their taps reach - a run of indices increasing with the vertex - are blended.
+void CWaveGrid::BlendBand(int cascade, float t)
+{
+	const Band& band = mBands[cascade];
+	const wave_complex from = static_cast<wave_real>(1.0f - (t - BandTime(cascade, band.index[0])) / BandInterval(cascade));
+	const wave_complex to = 1.0f - from;
+	const int pitch = FIELD_COUNT * mSize;
+
+	int first = mCascadeTaps[(cascade - 1) * mSizePlus1].index0;
+	int last = mCascadeTaps[(cascade - 1) * mSizePlus1 + mSize].index1;
+	if (last < first) {
+		first = 0;
+		last = mSize - 1;
+	}
 
-			if (gridY == 0) {
-				mWaterGrid[j + mSize].vertex.y = mTilde[i]._Val[0];
-				mWaterGrid[j + mSize].vertex.x = mWaterGrid[j + mSize].originalPos.x + mTildeDX[i]._Val[0] * lambda;
-				mWaterGrid[j + mSize].vertex.z = mWaterGrid[j + mSize].originalPos.z + mTildeDZ[i]._Val[0] * lambda;
-				mWaterGrid[j + mSize].normal = n;
+	auto blendRows = [&](int begin, int end) {
+		for (int row = first + begin; row < first + end; row++) {
+			const wave_complex* solve0 = &band.fields[0][row * pitch];
+			const wave_complex* solve1 = &band.fields[1][row * pitch];
+			wave_complex* fields = &mSpectrum[row * mSpectrumPitch + cascade * pitch];
+			for (int field = 0; field < FIELD_COUNT; field++) {
+				for (int column = field * mSize + first; column <= field * mSize + last; column++) {
+					fields[column] = solve0[column] * from + solve1[column] * to;
+				}
 			}
+		}
+	};
+	mThreadPool.ParallelFor(last - first + 1, blendRows);
+}
+
+void CWaveGrid::SetAmortisedRate(float solvesPerSecond)
+{
+	const float interval = 1.0f / std::max(solvesPerSecond, 1.0f);
+	if (interval == mKeyframeInterval) return;
+	mKeyframeInterval = interval;
+	ClearKeyframes();
+}
+
+void CWaveGrid::ClearKeyframes()
+{
+	for (Keyframe& keyframe : mKeyframes) keyframe.index = INT_MIN;
+}
+
+// Sum of four keyframes' values for vertices j to j + 3, each scaled by its weight
+static inline __m128 BlendKeyframes(const float* const values[4], const __m128 weights[4], int j)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(values[0] + j), weights[0]), _mm_mul_ps(_mm_loadu_ps(values[1] + j), weights[1])),
+	                  _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(values[2] + j), weights[2]), _mm_mul_ps(_mm_loadu_ps(values[3] + j), weights[3])));
+}
+
+static inline __m128 LerpKeyframes(const float* from, const float* to, __m128 u, int j)
+{
+	const __m128 start = _mm_loadu_ps(from + j);
+	return _mm_add_ps(start, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(to + j), start), u));
+}
+
+// Catmull-Rom splines through every vertex position and normal keep the motion smooth through the keyframes, as
+// linear blending would not, and give the query texels the spline's own velocity; foam and the Jacobian are blended
+// linearly. The surface is a function of time alone, so the keyframes ahead of t are simply solved early: normally
+// one FFT per keyframe interval, four after a jump in time or a change of resolution or length. Wind and amplitude
+// changes blend in over the next few keyframes.
+// Keyframe time t lies between keyframes k and k + 1, which with k - 1 and k + 2 hold all four points the spline needs.
+// Each of those found in its slot from an earlier frame is reused; the rest are solved in time order, so the foam of
+// every keyframe carries on from the one before, and the blended frame is then built from the four in one pass.
+void CWaveGrid::WavesEvaluationAmortised(float t)
+{
+	ApplySpectrumChanges();
+
+	const float position = t / mKeyframeInterval;
+	const int first = static_cast<int>(floor(position)) - 1;
+	for (int index = first; index < first + KEYFRAME_COUNT; index++) {
+		if (mKeyframes[KeyframeSlot(index)].index != index) SolveKeyframe(index);
+	}
+
+	// Catmull-Rom weights of the four keyframes at u from keyframe k to k + 1, and their derivatives over time
+	const float u = position - (first + 1);
+	const float u2 = u * u, u3 = u2 * u;
+	const float weights[KEYFRAME_COUNT] = { 0.5f * (-u3 + 2.0f * u2 - u), 0.5f * (3.0f * u3 - 5.0f * u2 + 2.0f),
+	                                        0.5f * (-3.0f * u3 + 4.0f * u2 + u), 0.5f * (u3 - u2) };
+	const float rate = 0.5f / mKeyframeInterval;
+	const float rates[KEYFRAME_COUNT] = { rate * (-3.0f * u2 + 4.0f * u - 1.0f), rate * (9.0f * u2 - 10.0f * u),
+	                                      rate * (-9.0f * u2 + 8.0f * u + 1.0f), rate * (3.0f * u2 - 2.0f * u) };
+	const __m128 blend[KEYFRAME_COUNT] = { _mm_set1_ps(weights[0]), _mm_set1_ps(weights[1]), _mm_set1_ps(weights[2]), _mm_set1_ps(weights[3]) };
+	const __m128 slope[KEYFRAME_COUNT] = { _mm_set1_ps(rates[0]), _mm_set1_ps(rates[1]), _mm_set1_ps(rates[2]), _mm_set1_ps(rates[3]) };
+	const __m128 linear = _mm_set1_ps(u);
+	const Keyframe* keyframes[KEYFRAME_COUNT];
+	for (int n = 0; n < KEYFRAME_COUNT; n++) keyframes[n] = &mKeyframes[KeyframeSlot(first + n)];
+
+	WaterGridVertex* vertices = mVertexSink->Begin(mSizePlus1 * mSizePlus1);
 
-			if (gridX == 0) {
-				mWaterGrid[j + mSizePlus1 * mSize].vertex.y = mTilde[i]._Val[0];
-				mWaterGrid[j + mSizePlus1 * mSize].vertex.x = mWaterGrid[j + mSizePlus1 * mSize].originalPos.x + mTildeDX[i]._Val[0] * lambda;
-				mWaterGrid[j + mSizePlus1 * mSize].vertex.z = mWaterGrid[j + mSizePlus1 * mSize].originalPos.z + mTildeDZ[i]._Val[0] * lambda;
-				mWaterGrid[j + mSizePlus1 * mSize].normal = n;
+	// Four vertices at a time; a row's last group is moved back to end with the row, redoing a few vertices, which
+	// gives the same result since nothing read is written
+	auto blendRows = [&](int begin, int end) {
+		const float* positionX[KEYFRAME_COUNT], *positionY[KEYFRAME_COUNT], *positionZ[KEYFRAME_COUNT];
+		const float* normalX[KEYFRAME_COUNT], *normalY[KEYFRAME_COUNT], *normalZ[KEYFRAME_COUNT];
+		const float* jacobian[KEYFRAME_COUNT], *foam[KEYFRAME_COUNT];
+		for (int n = 0; n < KEYFRAME_COUNT; n++) {
+			positionX[n] = keyframes[n]->positionX.data();
+			positionY[n] = keyframes[n]->positionY.data();
+			positionZ[n] = keyframes[n]->positionZ.data();
+			normalX[n] = keyframes[n]->normalX.data();
+			normalY[n] = keyframes[n]->normalY.data();
+			normalZ[n] = keyframes[n]->normalZ.data();
+			jacobian[n] = keyframes[n]->jacobian.data();
+			foam[n] = keyframes[n]->foam.data();
+		}
+		const __m128 one = _mm_set1_ps(1.0f);
+		int j;
+
+		for (int gridX = begin; gridX < end; gridX++) {
+			const __m128 restZ = _mm_set1_ps(mRestZ[gridX]);
+			for (int column = 0; column < mSizePlus1; column += 4) {
+				column = std::min(column, mSizePlus1 - 4);
+				j = gridX * mSizePlus1 + column;
+
+				const __m128 x = BlendKeyframes(positionX, blend, j);
+				const __m128 y = BlendKeyframes(positionY, blend, j);
+				const __m128 z = BlendKeyframes(positionZ, blend, j);
+				__m128 normalXs = BlendKeyframes(normalX, blend, j);
+				__m128 normalYs = BlendKeyframes(normalY, blend, j);
+				__m128 normalZs = BlendKeyframes(normalZ, blend, j);
+				const __m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(normalXs, normalXs),
+					_mm_mul_ps(normalYs, normalYs)), _mm_mul_ps(normalZs, normalZs))));
+				normalXs = _mm_mul_ps(normalXs, inverseLength);
+				normalYs = _mm_mul_ps(normalYs, inverseLength);
+				normalZs = _mm_mul_ps(normalZs, inverseLength);
+
+				_mm_storeu_ps(&mPositionX[j], x);
+				_mm_storeu_ps(&mPositionY[j], y);
+				_mm_storeu_ps(&mPositionZ[j], z);
+				_mm_storeu_ps(&mNormalX[j], normalXs);
+				_mm_storeu_ps(&mNormalY[j], normalYs);
+				_mm_storeu_ps(&mNormalZ[j], normalZs);
+				// the spline can overshoot, which these must not
+				_mm_storeu_ps(&mJacobian[j], LerpKeyframes(jacobian[1], jacobian[2], linear, j));
+				_mm_storeu_ps(&mFoam[j], LerpKeyframes(foam[1], foam[2], linear, j));
+
+				// Transposed into one texel per vertex, the fourth lanes falling in the unused ones
+				__m128 displacement[4] = { _mm_sub_ps(x, _mm_loadu_ps(&mRestX[column])), y, _mm_sub_ps(z, restZ), _mm_setzero_ps() };
+				__m128 normal[4] = { normalXs, normalYs, normalZs, _mm_setzero_ps() };
+				__m128 velocity[4] = { BlendKeyframes(positionX, slope, j), BlendKeyframes(positionY, slope, j),
+				                       BlendKeyframes(positionZ, slope, j), _mm_setzero_ps() };
+				_MM_TRANSPOSE4_PS(displacement[0], displacement[1], displacement[2], displacement[3]);
+				_MM_TRANSPOSE4_PS(normal[0], normal[1], normal[2], normal[3]);
+				_MM_TRANSPOSE4_PS(velocity[0], velocity[1], velocity[2], velocity[3]);
+				for (int n = 0; n < 4; n++) {
+					QueryTexel& texel = mQueryTexels[j + n];
+					_mm_store_ps(texel.displacement, displacement[n]);
+					_mm_store_ps(texel.normal, normal[n]);
+					_mm_store_ps(texel.velocity, velocity[n]);
+				}
 			}
+
+			EmitRow(vertices, gridX);
+		}
+	};
+	mThreadPool.ParallelFor(mSizePlus1, blendRows);
+
+	mVertexSink->End();
+
+	// A following WavesEvaluationFFT carries on from this frame
+	mFoamTime = t;
+	mQueryTime = t;
+}
+
+// Runs WavesEvaluationFFT for keyframe index into a scratch sink, starting from the foam of the keyframe before if
+// there is one, and keeps the vertex arrays it leaves
+void CWaveGrid::SolveKeyframe(int index)
+{
+	const Keyframe& previous = mKeyframes[KeyframeSlot(index - 1)];
+	if (previous.index == index - 1) {
+		mFoam = previous.foam;
+		mFoamTime = (index - 1) * mKeyframeInterval;
+	}
+	else mFoamTime = -FLT_MAX;
+
+	WaterVertexSink* sink = mVertexSink;
+	mVertexSink = &mKeyframeSink;
+	try {
+		WavesEvaluationFFT(index * mKeyframeInterval);
+	}
+	catch (...) {
+		mVertexSink = sink;
+		throw;
+	}
+	mVertexSink = sink;
+
+	Keyframe& keyframe = mKeyframes[KeyframeSlot(index)];
+	keyframe.positionX = mPositionX;
+	keyframe.positionY = mPositionY;
+	keyframe.positionZ = mPositionZ;
+	keyframe.normalX = mNormalX;
+	keyframe.normalY = mNormalY;
+	keyframe.normalZ = mNormalZ;
+	keyframe.jacobian = mJacobian;
+	keyframe.foam = mFoam;
+	keyframe.index = index;
+}
+
+// Foam left from earlier frames fades exponentially; a jump back in time starts it afresh. Velocities for the
+// query texels come from the time since the last frame, or are zero after a jump back.
+void CWaveGrid::AdvanceFrameTime(float t, float& foamFade, float& inverseTimeStep)
+{
+	foamFade = t >= mFoamTime ? exp((mFoamTime - t) / FOAM_DECAY_TIME) : 0.0f;
+	mFoamTime = t;
+	inverseTimeStep = t > mQueryTime ? 1.0f / (t - mQueryTime) : 0.0f;
+	mQueryTime = t;
+}
+
+// Turns the fields at one vertex into its displaced position, normal, query texel, Jacobian and foam
+void CWaveGrid::ResolveVertex(int row, int column, const SurfaceSample& sample, float foamFade, float inverseTimeStep)
+{
+	const float lambda = -1.0f;
+	const int j = row * mSizePlus1 + column;
+
+	mPositionY[j] = sample.height;
+	mPositionX[j] = mRestX[column] + sample.dX * lambda;
+	mPositionZ[j] = mRestZ[row] + sample.dZ * lambda;
+
+	// normalise (-slopeX, 1, -slopeZ)
+	const float inverseLength = InvSqrt(sample.slopeX * sample.slopeX + 1.0f + sample.slopeZ * sample.slopeZ);
+	mNormalX[j] = -sample.slopeX * inverseLength;
+	mNormalY[j] = inverseLength;
+	mNormalZ[j] = -sample.slopeZ * inverseLength;
+	StoreQueryTexel(j, sample.dX * lambda, sample.height, sample.dZ * lambda, mNormalX[j], mNormalY[j], mNormalZ[j], inverseTimeStep);
+
+	// determinant of the Jacobian of the displaced position (x + lambda * Dx, z + lambda * Dz)
+	const float jacobian = (1.0f + lambda * sample.dXdX) * (1.0f + lambda * sample.dZdZ) - lambda * lambda * sample.dXdZ * sample.dXdZ;
+	mJacobian[j] = jacobian;
+	mFoam[j] = std::max(mFoam[j] * foamFade, std::min(1.0f, std::max(0.0f, (FOAM_THRESHOLD - jacobian) / FOAM_THRESHOLD)));
+}
+
+// Velocity is taken from the texel's previous displacement before it is overwritten, so it costs no extra pass
+void CWaveGrid::StoreQueryTexel(int j, float dX, float height, float dZ, float normalX, float normalY, float normalZ, float inverseTimeStep)
+{
+	QueryTexel& texel = mQueryTexels[j];
+	texel.velocity[0] = (dX - texel.displacement[0]) * inverseTimeStep;
+	texel.velocity[1] = (height - texel.displacement[1]) * inverseTimeStep;
+	texel.velocity[2] = (dZ - texel.displacement[2]) * inverseTimeStep;
+	texel.displacement[0] = dX;
+	texel.displacement[1] = height;
+	texel.displacement[2] = dZ;
+	texel.normal[0] = normalX;
+	texel.normal[1] = normalY;
+	texel.normal[2] = normalZ;
+}
+
+// Adds weight times the fields of a coarser cascade in spectrum, interpolated bilinearly at vertex (row, column), to
+// the running sums
+void CWaveGrid::AddCascade(const AlignedVector<wave_complex>& spectrum, int cascade, int row, int column, float weight,
+                           SurfaceSample& sample)
+{
+	const CascadeTap& tapZ = mCascadeTaps[(cascade - 1) * mSizePlus1 + row];
+	const CascadeTap& tapX = mCascadeTaps[(cascade - 1) * mSizePlus1 + column];
+	const int sampleRows[] = { tapZ.index0, tapZ.index1 };
+	const float weightsZ[] = { tapZ.weight0 * weight, tapZ.weight1 * weight };
+	const int sampleColumns[] = { tapX.index0, tapX.index1 };
+	const float weightsX[] = { tapX.weight0, tapX.weight1 };
+	float tapWeight;
+
+	for (int a = 0; a < 2; a++) {
+		const wave_complex* fields = &spectrum[sampleRows[a] * mSpectrumPitch + cascade * FIELD_COUNT * mSize];
+		for (int b = 0; b < 2; b++) {
+			const int index = sampleColumns[b];
+			tapWeight = weightsZ[a] * weightsX[b];
+			sample.height += fields[FIELD_HEIGHT_SLOPE_X * mSize + index]._Val[0] * tapWeight;
+			sample.slopeX += fields[FIELD_HEIGHT_SLOPE_X * mSize + index]._Val[1] * tapWeight;
+			sample.slopeZ += fields[FIELD_SLOPE_Z_DX * mSize + index]._Val[0] * tapWeight;
+			sample.dX += fields[FIELD_SLOPE_Z_DX * mSize + index]._Val[1] * tapWeight;
+			sample.dZ += fields[FIELD_DZ_DXDX * mSize + index]._Val[0] * tapWeight;
+			sample.dXdX += fields[FIELD_DZ_DXDX * mSize + index]._Val[1] * tapWeight;
+			sample.dZdZ += fields[FIELD_DZDZ_DXDZ * mSize + index]._Val[0] * tapWeight;
+			sample.dXdZ += fields[FIELD_DZDZ_DXDZ * mSize + index]._Val[1] * tapWeight;
+		}
+	}
+}
+
+// Deep-water waves move at omega = sqrt(g |k|); over a sea bed of depth h they slow to sqrt(g |k| tanh(|k| h)), the
+// longest waves first. Rather than a frequency per vertex, the spectrum is solved once more at each of DEPTH_BANDS
+// depths (SHALLOWEST_DEPTH, doubling from there) that some vertex lies next to, and each vertex blends the two solves
+// either side of its depth, linearly in log depth, reaching deep water at twice the deepest band. Only the cascades
+// with waves long enough to feel a band's depth are solved again for it, so each band in use costs at most another
+// full solve and a tile that is all deep water costs nothing extra. Wavelengths stay those of the spectrum, only the
+// speed changes, and the two bands at a vertex drift apart in phase, so the blend beats slowly. The Gerstner sum keeps
+// to deep water, and a baked animation to the map it was baked with
+void CWaveGrid::SetBathymetry(const std::vector<float>& depths, int resolution)
+{
+	if (!depths.empty() && (resolution < 2 || depths.size() != static_cast<size_t>(resolution) * resolution)) {
+		throw std::runtime_error("Bathymetry needs resolution x resolution depths, at least 2 x 2");
+	}
+	mBathymetry = depths;
+	mBathymetryResolution = depths.empty() ? 0 : resolution;
+	UpdateVertexDepths();
+	mWaveTablesStale = true; // for the bands' frequencies, and the surface jumps like after a new length
+	for (auto& lod : mLods) lod->SetBathymetry(depths, resolution);
+}
+
+// Each vertex's depth, interpolated bilinearly from the map, as a position between two bands on a log2 scale
+void CWaveGrid::UpdateVertexDepths()
+{
+	for (DepthBand& band : mDepthBands) band.used = false;
+	if (mBathymetry.empty()) return;
+
+	mVertexDepthBand.resize(mSizePlus1 * mSizePlus1);
+	mVertexDepthWeight.resize(mSizePlus1 * mSizePlus1);
+	const int last = mBathymetryResolution - 1;
+	const float scale = static_cast<float>(last) / mSize;
+	for (int row = 0; row < mSizePlus1; row++) {
+		const float v = row * scale;
+		const int mapRow = std::min(static_cast<int>(v), last - 1);
+		const float fractionZ = v - mapRow;
+		for (int column = 0; column < mSizePlus1; column++) {
+			const float u = column * scale;
+			const int mapColumn = std::min(static_cast<int>(u), last - 1);
+			const float fractionX = u - mapColumn;
+			const float* near = &mBathymetry[mapRow * mBathymetryResolution + mapColumn];
+			const float* far = near + mBathymetryResolution;
+			const float depth = (near[0] + (near[1] - near[0]) * fractionX) * (1.0f - fractionZ) +
+			                    (far[0] + (far[1] - far[0]) * fractionX) * fractionZ;
+
+			const float position = log2(std::max(depth, SHALLOWEST_DEPTH) / SHALLOWEST_DEPTH);
+			const int band = std::min(static_cast<int>(position), DEPTH_BANDS);
+			const float weight = band < DEPTH_BANDS ? position - band : 0.0f;
+			const int j = row * mSizePlus1 + column;
+			mVertexDepthBand[j] = static_cast<unsigned char>(band);
+			mVertexDepthWeight[j] = weight;
+			if (band < DEPTH_BANDS) mDepthBands[band].used = true;
+			if (weight > 0.0f && band + 1 < DEPTH_BANDS) mDepthBands[band + 1].used = true;
+		}
+	}
+}
+
+// Solves each band in use for t in a spectrum of its own, for just the cascades it changes. mSpectrum already holds
+// the deep-water solve, which the bands share for the rest.
+void CWaveGrid::SolveDepthBands(float t)
+{
+	for (DepthBand& band : mDepthBands) {
+		if (!band.used) continue;
+		int cascades[MAX_CASCADES];
+		float times[MAX_CASCADES];
+		int count = 0;
+		for (int cascade = 0; cascade < mNumCascades; cascade++) {
+			if (!band.differs[cascade]) continue;
+			cascades[count] = cascade;
+			times[count++] = t;
 		}
+		if (count == 0) continue;
+
+		band.spectrum.resize(mSpectrum.size());
+		std::swap(mSpectrum, band.spectrum);
+		SolveCascades(count, cascades, times, band.dispersionStep);
+		std::swap(mSpectrum, band.spectrum);
+	}
+}
+
+// Adds weight times the fields of every cascade at vertex (row, column) as depth band solved them, band DEPTH_BANDS
+// being deep water
+void CWaveGrid::AddDepthBand(int band, float weight, int row, int column, SurfaceSample& sample)
+{
+	const float signs[] = { 1.0f, -1.0f };
+	auto solve = [&](int cascade) -> const AlignedVector<wave_complex>& {
+		return band < DEPTH_BANDS && mDepthBands[band].differs[cascade] ? mDepthBands[band].spectrum : mSpectrum;
+	};
+
+	const int gridX = row < mSize ? row : 0;
+	const int gridY = column < mSize ? column : 0;
+	const wave_complex* fields = &solve(0)[gridX * mSpectrumPitch];
+	const float scale = weight * signs[(gridY + gridX) & 1];
+	sample.height += fields[FIELD_HEIGHT_SLOPE_X * mSize + gridY]._Val[0] * scale;
+	sample.slopeX += fields[FIELD_HEIGHT_SLOPE_X * mSize + gridY]._Val[1] * scale;
+	sample.slopeZ += fields[FIELD_SLOPE_Z_DX * mSize + gridY]._Val[0] * scale;
+	sample.dX += fields[FIELD_SLOPE_Z_DX * mSize + gridY]._Val[1] * scale;
+	sample.dZ += fields[FIELD_DZ_DXDX * mSize + gridY]._Val[0] * scale;
+	sample.dXdX += fields[FIELD_DZ_DXDX * mSize + gridY]._Val[1] * scale;
+	sample.dZdZ += fields[FIELD_DZDZ_DXDZ * mSize + gridY]._Val[0] * scale;
+	sample.dXdZ += fields[FIELD_DZDZ_DXDZ * mSize + gridY]._Val[1] * scale;
+	for (int cascade = 1; cascade < mNumCascades; cascade++) {
+		AddCascade(solve(cascade), cascade, row, column, weight, sample);
+	}
+}
+
+// Unnormalised inverse 2D transform of the packed fields of count cascades in mSpectrum, in place.
+// The columns of all fields are transformed as one SIMD batch, each field is transposed within the shared rows,
+// and the new columns are transformed the same way. The final transpose is skipped: the spectrum went in
+// transposed, so field value (gridX, gridY) comes out in row gridX, column gridY.
+// The backward plan skips the 1/N scaling of simple_fft::IFFT so the result matches the HDN sum.
+// Threads take whole blocks of columns so the SIMD kernels see full registers, and transpose whole tile rows. Each
+// cascade's columns are contiguous, so a range of blocks is one batch per cascade it touches.
+void CWaveGrid::InverseFFT2DFields(int count, const int* cascades)
+{
+	const int columnBlock = 16;
+	const int cascadeColumns = FIELD_COUNT * mSize;
+	const int cascadeBlocks = (cascadeColumns + columnBlock - 1) / columnBlock;
+	auto transformColumns = [&](int begin, int end) {
+		int item, last, first, stop;
+		for (int block = begin; block < end; block = last) {
+			item = block / cascadeBlocks;
+			last = std::min(end, (item + 1) * cascadeBlocks);
+			first = cascades[item] * cascadeColumns + (block - item * cascadeBlocks) * columnBlock;
+			stop = cascades[item] * cascadeColumns + std::min((last - item * cascadeBlocks) * columnBlock, cascadeColumns);
+			mFFTPlan.executeBatch(mSpectrum.data() + first, stop - first, mSpectrumPitch);
+		}
+	};
+
+	// Tile row r holds (tileRows - r) tiles, so rows are taken from both ends alternately to even out the ranges
+	const int tileRows = static_cast<int>(simple_fft::transposeTileRows(mSize));
+	auto transposeFields = [&](int begin, int end) {
+		int field, item, tileRow;
+		for (int i = begin; i < end; i++) {
+			field = cascades[i / (FIELD_COUNT * tileRows)] * FIELD_COUNT + (i / tileRows) % FIELD_COUNT;
+			item = i % tileRows;
+			tileRow = (item & 1) ? tileRows - 1 - item / 2 : item / 2;
+			simple_fft::transposeSquareTiles(mSpectrum.data() + field * mSize, mSize, mSpectrumPitch, tileRow, tileRow + 1);
+		}
+	};
+
+	mThreadPool.ParallelFor(count * cascadeBlocks, transformColumns);
+	mThreadPool.ParallelFor(count * FIELD_COUNT * tileRows, transposeFields);
+	mThreadPool.ParallelFor(count * cascadeBlocks, transformColumns);
+}
+
+void CWaveGrid::SetVertexSink(WaterVertexSink* sink)
+{
+	mVertexSink = sink ? sink : mMeshSink;
+}
+
+// The extra last column and row repeat the first ones, shifted by one tile length, so neighbouring tiles meet
+// without a seam. WrapRow fills the last column of a row, WrapLastRow copies the whole first row (wrap included).
+void CWaveGrid::WrapRow(int gridX)
+{
+	const int first = gridX * mSizePlus1;
+	const int last = first + mSize;
+	mPositionX[last] = mPositionX[first] + mLength;
+	mPositionY[last] = mPositionY[first];
+	mPositionZ[last] = mPositionZ[first];
+	mNormalX[last] = mNormalX[first];
+	mNormalY[last] = mNormalY[first];
+	mNormalZ[last] = mNormalZ[first];
+}
+
+void CWaveGrid::WrapLastRow()
+{
+	const int last = mSize * mSizePlus1;
+	for (int gridY = 0; gridY < mSizePlus1; gridY++) {
+		mPositionX[last + gridY] = mPositionX[gridY];
+		mPositionY[last + gridY] = mPositionY[gridY];
+		mPositionZ[last + gridY] = mPositionZ[gridY] + mLength;
+		mNormalX[last + gridY] = mNormalX[gridY];
+		mNormalY[last + gridY] = mNormalY[gridY];
+		mNormalZ[last + gridY] = mNormalZ[gridY];
+	}
+}
+
+// Interleaves one finished row of the vertex arrays into the sink's memory, in order, without reading it back.
+// UVs are rewritten too since mapping discards the whole buffer; they run as in the grid Mesh constructor.
+// Ripples, sampled in world space where each vertex ends up, lift it and tilt its normal by their slope.
+// Keyframe solves are never shown and levels of detail are not given the ripples, so they get none, and nothing is
+// sampled while every tile sleeps.
+void CWaveGrid::EmitRow(WaterGridVertex* vertices, int gridX)
+{
+	const float uStep = 1.0f / mSize;
+	const float v = 1.0f - gridX * uStep;
+	const int first = gridX * mSizePlus1;
+	const bool ripples = mInteractiveWaves && mInteractiveWaves->GetAwakeTileCount() > 0 && mVertexSink != &mKeyframeSink;
+	const CVector3 origin = ripples ? mWaterGridModel->Position() : CVector3(0.0f, 0.0f, 0.0f);
+
+	WaterGridVertex* vertex = vertices + first;
+	for (int gridY = 0; gridY < mSizePlus1; gridY++, vertex++) {
+		CVector3 position(mPositionX[first + gridY], mPositionY[first + gridY], mPositionZ[first + gridY]);
+		CVector3 normal(mNormalX[first + gridY], mNormalY[first + gridY], mNormalZ[first + gridY]);
+		if (ripples) mInteractiveWaves->Lift(origin, position, normal);
+		vertex->position = position;
+		vertex->normal = normal;
+		vertex->uv = CVector2(gridY * uStep, v);
 	}
+}
+
+// Baked animation file: a BakedWavesHeader, padded to BAKED_DATA_OFFSET, then numFrames frames of frameStride bytes.
+// A frame is a BakedFrameScale followed by BAKED_PLANE_COUNT planes of mSizePlus1 x mSizePlus1 16-bit values in
+// vertex order, wrapped last row and column included since coarser cascades do not repeat. Displacements from the rest
+// position are stored as multiples of the frame's scale for that component, normals as x and z times 32767 with
+// y recovered from the unit length, and foam times 32767. At 12 bytes a vertex a 256 x 256 grid takes about 780KB a frame.
+struct BakedWavesHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t size;
+	uint32_t numFrames;
+	float length;
+	float repeatTime;
+	uint32_t frameStride;
+	uint32_t reserved;
+};
+
+struct BakedFrameScale {
+	float displacementX, height, displacementZ, unused;
+};
+
+enum BakedPlane {
+	BAKED_DISPLACEMENT_X = 0,
+	BAKED_HEIGHT,
+	BAKED_DISPLACEMENT_Z,
+	BAKED_NORMAL_X,
+	BAKED_NORMAL_Z,
+	BAKED_FOAM,
+	BAKED_PLANE_COUNT
+};
+
+static const char BAKED_MAGIC[4] = { 'W', 'A', 'V', 'B' };
+static const uint32_t BAKED_VERSION = 3;
+static const size_t BAKED_DATA_OFFSET = 64;
+static const float BAKED_NORMAL_SCALE = 32767.0f;
+static const float BAKED_FOAM_SCALE = 32767.0f;
+
+static size_t BakedFrameStride(int size)
+{
+	const size_t bytes = sizeof(BakedFrameScale) + BAKED_PLANE_COUNT * (size + 1) * (size + 1) * sizeof(int16_t);
+	return (bytes + 63) & ~static_cast<size_t>(63);
+}
+
+void CWaveGrid::BakeAnimation(const std::string& fileName, float framesPerSecond)
+{
+	const int numFrames = std::max(1, static_cast<int>(REPEAT_TIME * framesPerSecond + 0.5f));
+	const int planeSize = mSizePlus1 * mSizePlus1;
+	const size_t frameStride = BakedFrameStride(mSize);
+
+	std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+	if (!file) throw std::runtime_error("Cannot create " + fileName);
+
+	std::vector<char> block(std::max(BAKED_DATA_OFFSET, frameStride), 0);
+	BakedWavesHeader header = {};
+	std::memcpy(header.magic, BAKED_MAGIC, sizeof(BAKED_MAGIC));
+	header.version = BAKED_VERSION;
+	header.size = mSize;
+	header.numFrames = numFrames;
+	header.length = mLength;
+	header.repeatTime = REPEAT_TIME;
+	header.frameStride = static_cast<uint32_t>(frameStride);
+	std::memcpy(block.data(), &header, sizeof(header));
+	file.write(block.data(), BAKED_DATA_OFFSET);
+
+	// The frames are evaluated as usual, into a scratch sink and with every cascade transformed each frame, and read
+	// back from the vertex arrays
+	CpuVertexSink scratch;
+	WaterVertexSink* sink = mVertexSink;
+	const float bandInterval = mBandInterval;
+	mVertexSink = &scratch;
+	mBandInterval = 0.0f;
+	try {
+		// Foam depends on the frames before, so the end of the period is run through first and the loop starts with
+		// the foam it will end with
+		const int warmUpFrames = std::min(numFrames, static_cast<int>(ceil(5.0f * FOAM_DECAY_TIME * numFrames / REPEAT_TIME)));
+		for (int frame = -warmUpFrames; frame < 0; frame++) WavesEvaluationFFT(frame * REPEAT_TIME / numFrames);
+
+		std::fill(block.begin(), block.end(), 0);
+		BakedFrameScale* scale = reinterpret_cast<BakedFrameScale*>(block.data());
+		int16_t* planes = reinterpret_cast<int16_t*>(block.data() + sizeof(BakedFrameScale));
+		int j;
+
+		for (int frame = 0; frame < numFrames && file; frame++) {
+			WavesEvaluationFFT(frame * REPEAT_TIME / numFrames);
 
-	for (int i = 0; i < mSizePlus1; i++) {
-		for (int j = 0; j < mSizePlus1; j++) {
-			vertexPositions.push_back(mWaterGrid[i * mSizePlus1 + j].vertex);
-			vertexNormals.push_back(mWaterGrid[i * mSizePlus1 + j].normal);
+			float maxX = 0.0f, maxY = 0.0f, maxZ = 0.0f;
+			for (int gridX = 0; gridX < mSizePlus1; gridX++) {
+				for (int gridY = 0; gridY < mSizePlus1; gridY++) {
+					j = gridX * mSizePlus1 + gridY;
+					maxX = std::max(maxX, std::abs(mPositionX[j] - mRestX[gridY]));
+					maxY = std::max(maxY, std::abs(mPositionY[j]));
+					maxZ = std::max(maxZ, std::abs(mPositionZ[j] - mRestZ[gridX]));
+				}
+			}
+			scale->displacementX = maxX > 0.0f ? maxX / 32767.0f : 1.0f;
+			scale->height = maxY > 0.0f ? maxY / 32767.0f : 1.0f;
+			scale->displacementZ = maxZ > 0.0f ? maxZ / 32767.0f : 1.0f;
+
+			for (int gridX = 0; gridX < mSizePlus1; gridX++) {
+				for (int gridY = 0; gridY < mSizePlus1; gridY++) {
+					j = gridX * mSizePlus1 + gridY;
+					planes[BAKED_DISPLACEMENT_X * planeSize + j] = static_cast<int16_t>(lround((mPositionX[j] - mRestX[gridY]) / scale->displacementX));
+					planes[BAKED_HEIGHT * planeSize + j] = static_cast<int16_t>(lround(mPositionY[j] / scale->height));
+					planes[BAKED_DISPLACEMENT_Z * planeSize + j] = static_cast<int16_t>(lround((mPositionZ[j] - mRestZ[gridX]) / scale->displacementZ));
+					planes[BAKED_NORMAL_X * planeSize + j] = static_cast<int16_t>(lround(mNormalX[j] * BAKED_NORMAL_SCALE));
+					planes[BAKED_NORMAL_Z * planeSize + j] = static_cast<int16_t>(lround(mNormalZ[j] * BAKED_NORMAL_SCALE));
+					planes[BAKED_FOAM * planeSize + j] = static_cast<int16_t>(lround(mFoam[j] * BAKED_FOAM_SCALE));
+				}
+			}
+			file.write(block.data(), frameStride);
 		}
 	}
-	mWaterGridMesh->UpdateNodeVertexBuffer(0, mSize, vertexPositions, vertexNormals);
+	catch (...) {
+		mVertexSink = sink;
+		mBandInterval = bandInterval;
+		throw;
+	}
+	mVertexSink = sink;
+	mBandInterval = bandInterval;
+
+	file.close();
+	if (!file) throw std::runtime_error("Failure writing " + fileName);
+}
+
+void CWaveGrid::LoadBakedAnimation(const std::string& fileName)
+{
+	std::unique_ptr<MappedFile> animation(new MappedFile(fileName));
+
+	BakedWavesHeader header;
+	if (animation->Size() < BAKED_DATA_OFFSET) throw std::runtime_error(fileName + " is not a baked wave animation");
+	std::memcpy(&header, animation->Data(), sizeof(header));
+	if (std::memcmp(header.magic, BAKED_MAGIC, sizeof(BAKED_MAGIC)) != 0 || header.version != BAKED_VERSION) {
+		throw std::runtime_error(fileName + " is not a baked wave animation");
+	}
+	if (header.size != static_cast<uint32_t>(mSize) || header.length != mLength || header.repeatTime != REPEAT_TIME) {
+		throw std::runtime_error(fileName + " was baked for a different wave grid");
+	}
+	if (header.numFrames == 0 || header.frameStride != BakedFrameStride(mSize) ||
+	    (animation->Size() - BAKED_DATA_OFFSET) / header.frameStride < header.numFrames) {
+		throw std::runtime_error(fileName + " is truncated");
+	}
+
+	mBakedAnimation = std::move(animation);
+	mBakedFrames = static_cast<int>(header.numFrames);
+	mBakedFrameStride = header.frameStride;
+}
+
+void CWaveGrid::UnloadBakedAnimation()
+{
+	mBakedAnimation.reset();
+	mBakedFrames = 0;
+}
+
+const unsigned char* CWaveGrid::BakedFrame(int frame) const
+{
+	return mBakedAnimation->Data() + BAKED_DATA_OFFSET + frame * mBakedFrameStride;
+}
+
+// Linear interpolation between the two baked frames either side of t. The last frame blends back into the first,
+// so playback loops seamlessly. Dequantisation is folded into the blend weights.
+void CWaveGrid::WavesPlayback(float t)
+{
+	if (!mBakedAnimation) throw std::runtime_error("No baked wave animation loaded");
+
+	double position = fmod(static_cast<double>(t), static_cast<double>(REPEAT_TIME)) / REPEAT_TIME * mBakedFrames;
+	if (position < 0.0) position += mBakedFrames;
+	const int frame0 = std::min(static_cast<int>(position), mBakedFrames - 1);
+	const int frame1 = (frame0 + 1) % mBakedFrames;
+	const float blend = static_cast<float>(position - frame0);
+
+	const BakedFrameScale* scale0 = reinterpret_cast<const BakedFrameScale*>(BakedFrame(frame0));
+	const BakedFrameScale* scale1 = reinterpret_cast<const BakedFrameScale*>(BakedFrame(frame1));
+	const int16_t* planes0 = reinterpret_cast<const int16_t*>(BakedFrame(frame0) + sizeof(BakedFrameScale));
+	const int16_t* planes1 = reinterpret_cast<const int16_t*>(BakedFrame(frame1) + sizeof(BakedFrameScale));
+	const int planeSize = mSizePlus1 * mSizePlus1;
+
+	const float x0 = (1.0f - blend) * scale0->displacementX, x1 = blend * scale1->displacementX;
+	const float y0 = (1.0f - blend) * scale0->height, y1 = blend * scale1->height;
+	const float z0 = (1.0f - blend) * scale0->displacementZ, z1 = blend * scale1->displacementZ;
+	const float n0 = (1.0f - blend) / BAKED_NORMAL_SCALE, n1 = blend / BAKED_NORMAL_SCALE;
+	const float f0 = (1.0f - blend) / BAKED_FOAM_SCALE, f1 = blend / BAKED_FOAM_SCALE;
+	const float inverseTimeStep = t > mQueryTime ? 1.0f / (t - mQueryTime) : 0.0f;
+	mQueryTime = t;
+
+	WaterGridVertex* vertices = mVertexSink->Begin(mSizePlus1 * mSizePlus1);
+
+	auto resolveRows = [&](int begin, int end) {
+		float normalX, normalZ;
+		int j;
+
+		for (int gridX = begin; gridX < end; gridX++) {
+			for (int gridY = 0; gridY < mSizePlus1; gridY++) {
+				j = gridX * mSizePlus1 + gridY;
+
+				mPositionX[j] = mRestX[gridY] + planes0[BAKED_DISPLACEMENT_X * planeSize + j] * x0 + planes1[BAKED_DISPLACEMENT_X * planeSize + j] * x1;
+				mPositionY[j] = planes0[BAKED_HEIGHT * planeSize + j] * y0 + planes1[BAKED_HEIGHT * planeSize + j] * y1;
+				mPositionZ[j] = mRestZ[gridX] + planes0[BAKED_DISPLACEMENT_Z * planeSize + j] * z0 + planes1[BAKED_DISPLACEMENT_Z * planeSize + j] * z1;
+
+				normalX = planes0[BAKED_NORMAL_X * planeSize + j] * n0 + planes1[BAKED_NORMAL_X * planeSize + j] * n1;
+				normalZ = planes0[BAKED_NORMAL_Z * planeSize + j] * n0 + planes1[BAKED_NORMAL_Z * planeSize + j] * n1;
+				mNormalX[j] = normalX;
+				mNormalY[j] = sqrt(std::max(0.0f, 1.0f - normalX * normalX - normalZ * normalZ));
+				mNormalZ[j] = normalZ;
+
+				mFoam[j] = planes0[BAKED_FOAM * planeSize + j] * f0 + planes1[BAKED_FOAM * planeSize + j] * f1;
+				StoreQueryTexel(j, mPositionX[j] - mRestX[gridY], mPositionY[j], mPositionZ[j] - mRestZ[gridX],
+				                mNormalX[j], mNormalY[j], mNormalZ[j], inverseTimeStep);
+			}
+
+			EmitRow(vertices, gridX);
+		}
+	};
+	mThreadPool.ParallelFor(mSizePlus1, resolveRows);
+
+	mVertexSink->End();
 }
 
 void CWaveGrid::WavesEvaluation(float t) {
 	float lambda = -1.0;
 	int index;
 	CVector2 x;
-	CVector2 d;
 	WaterGridNode hdn;
-	std::vector<CVector3> vertexPositions;
-	std::vector<CVector3> vertexNormals;
+	ApplySpectrumChanges();
 	for (int m_prime = 0; m_prime < mSize; m_prime++) {
 		for (int n_prime = 0; n_prime < mSize; n_prime++) {
 			index = m_prime * mSizePlus1 + n_prime;
 
-			x = CVector2(mWaterGrid[index].vertex.x, mWaterGrid[index].vertex.z);
+			x = CVector2(mPositionX[index], mPositionZ[index]);
 
 			hdn = HDN(x, t);
 
-			mWaterGrid[index].vertex.y = hdn.height._Val[0];
+			mPositionY[index] = hdn.height._Val[0];
 
-			mWaterGrid[index].vertex.x = mWaterGrid[index].originalPos.x + lambda * hdn.displacementVector.x;
-			mWaterGrid[index].vertex.z = mWaterGrid[index].originalPos.z + lambda * hdn.displacementVector.y;
+			mPositionX[index] = mRestX[n_prime] + lambda * hdn.displacementVector.x;
+			mPositionZ[index] = mRestZ[m_prime] + lambda * hdn.displacementVector.y;
 
-			mWaterGrid[index].normal.x = hdn.normal.x;
-			mWaterGrid[index].normal.y = hdn.normal.y;
-			mWaterGrid[index].normal.z = hdn.normal.z;
-
-			if (n_prime == 0 && m_prime == 0) {
-				mWaterGrid[index + mSize + mSizePlus1 * mSize].vertex.y = hdn.height._Val[0];
-				
-				mWaterGrid[index + mSize + mSizePlus1 * mSize].vertex.x = mWaterGrid[index + mSize + mSizePlus1 * mSize].originalPos.x + lambda * hdn.displacementVector.x;
-				mWaterGrid[index + mSize + mSizePlus1 * mSize].vertex.z = mWaterGrid[index + mSize + mSizePlus1 * mSize].originalPos.z + lambda * hdn.displacementVector.y;
-				
-				mWaterGrid[index + mSize + mSizePlus1 * mSize].normal.x = hdn.normal.x;
-				mWaterGrid[index + mSize + mSizePlus1 * mSize].normal.y = hdn.normal.y;
-				mWaterGrid[index + mSize + mSizePlus1 * mSize].normal.z = hdn.normal.z;
-			}
-			if (n_prime == 0) {
-				mWaterGrid[index + mSize].vertex.y = hdn.height._Val[0];
-				
-				mWaterGrid[index + mSize].vertex.x = mWaterGrid[index + mSize].originalPos.x + lambda * hdn.displacementVector.x;
-				mWaterGrid[index + mSize].vertex.z = mWaterGrid[index + mSize].originalPos.z + lambda * hdn.displacementVector.y;
-				
-				mWaterGrid[index + mSize].normal.x = hdn.normal.x;
-				mWaterGrid[index + mSize].normal.y = hdn.normal.y;
-				mWaterGrid[index + mSize].normal.z = hdn.normal.z;
-			}
-			if (m_prime == 0) {
-				mWaterGrid[index + mSizePlus1 * mSize].vertex.y = hdn.height._Val[0];
-				
-				mWaterGrid[index + mSizePlus1 * mSize].vertex.x = mWaterGrid[index + mSizePlus1 * mSize].originalPos.x + lambda * hdn.displacementVector.x;
-				mWaterGrid[index + mSizePlus1 * mSize].vertex.z = mWaterGrid[index + mSizePlus1 * mSize].originalPos.z + lambda * hdn.displacementVector.y;
-				
-				mWaterGrid[index + mSizePlus1 * mSize].normal.x = hdn.normal.x;
-				mWaterGrid[index + mSizePlus1 * mSize].normal.y = hdn.normal.y;
-				mWaterGrid[index + mSizePlus1 * mSize].normal.z = hdn.normal.z;
-			}
+			mNormalX[index] = hdn.normal.x;
+			mNormalY[index] = hdn.normal.y;
+			mNormalZ[index] = hdn.normal.z;
 		}
 	}
 
-	for (int i = 0; i < mSizePlus1; i++) {
-		for (int j = 0; j < mSizePlus1; j++) {
-			vertexPositions.push_back(mWaterGrid[i * mSizePlus1 + j].vertex);
-			vertexNormals.push_back(mWaterGrid[i * mSizePlus1 + j].normal);
+	WaterGridVertex* vertices = mVertexSink->Begin(mSizePlus1 * mSizePlus1);
+	for (int gridX = 0; gridX < mSize; gridX++) {
+		WrapRow(gridX);
+		EmitRow(vertices, gridX);
+	}
+	WrapLastRow();
+	EmitRow(vertices, mSize);
+	mVertexSink->End();
+}
+
+// Queries are independent, so they are shared out between the threads in blocks
+void CWaveGrid::QuerySurface(int count, const float* x, const float* z, float* height, CVector3* normal, CVector3* velocity)
+{
+	const int block = 1024;
+	auto queryBlocks = [&](int begin, int end) {
+		QuerySurfaceRange(begin * block, std::min(end * block, count), x, z, height, normal, velocity);
+	};
+	mThreadPool.ParallelFor((count + block - 1) / block, queryBlocks);
+}
+
+// SSE2 has no rounding instruction: truncate, then step down wherever that rounded a negative value up
+static inline __m128 FloorSSE(__m128 value)
+{
+	const __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(value));
+	return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, value), _mm_set1_ps(1.0f)));
+}
+
+// Where four query points fall on the grid: the first of the four texels around each (the others follow along the
+// row and one row down) and the bilinear weight of each of the four, lane by lane
+struct QueryCells {
+	alignas(16) int texel[4];
+	alignas(16) float weight[4][4];
+};
+
+// Constants for LocateQueryCells, one per lane
+struct QueryGrid {
+	__m128 toGrid, centre, size, inverseSize, lastCell, pitch;
+};
+
+// Finds the cells holding rest positions (restX, restZ), wrapped onto the tile
+static inline void LocateQueryCells(const QueryGrid& grid, __m128 restX, __m128 restZ, QueryCells& cells)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	__m128 u = _mm_add_ps(_mm_mul_ps(restX, grid.toGrid), grid.centre);
+	__m128 v = _mm_add_ps(_mm_mul_ps(restZ, grid.toGrid), grid.centre);
+	u = _mm_sub_ps(u, _mm_mul_ps(FloorSSE(_mm_mul_ps(u, grid.inverseSize)), grid.size));
+	v = _mm_sub_ps(v, _mm_mul_ps(FloorSSE(_mm_mul_ps(v, grid.inverseSize)), grid.size));
+	const __m128 column = _mm_max_ps(_mm_min_ps(FloorSSE(u), grid.lastCell), zero);
+	const __m128 row = _mm_max_ps(_mm_min_ps(FloorSSE(v), grid.lastCell), zero);
+	u = _mm_sub_ps(u, column);
+	v = _mm_sub_ps(v, row);
+
+	_mm_store_si128(reinterpret_cast<__m128i*>(cells.texel), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(row, grid.pitch), column)));
+	const __m128 uRest = _mm_sub_ps(one, u);
+	const __m128 vRest = _mm_sub_ps(one, v);
+	_mm_store_ps(cells.weight[0], _mm_mul_ps(uRest, vRest));
+	_mm_store_ps(cells.weight[1], _mm_mul_ps(u, vRest));
+	_mm_store_ps(cells.weight[2], _mm_mul_ps(uRest, v));
+	_mm_store_ps(cells.weight[3], _mm_mul_ps(u, v));
+}
+
+// Blends one group of four floats per texel (texelFloats apart, rows pitch texels apart) for each of the four
+// points, then transposes so each output holds one component for all four points
+static inline void BlendQueryGroup(const float* group, int texelFloats, int pitch, const QueryCells& cells,
+                                   __m128& outX, __m128& outY, __m128& outZ)
+{
+	__m128 lanes[4];
+	for (int lane = 0; lane < 4; lane++) {
+		const float* t00 = group + cells.texel[lane] * texelFloats;
+		const float* t10 = t00 + pitch * texelFloats;
+		__m128 result = _mm_mul_ps(_mm_load_ps(t00), _mm_set1_ps(cells.weight[0][lane]));
+		result = _mm_add_ps(result, _mm_mul_ps(_mm_load_ps(t00 + texelFloats), _mm_set1_ps(cells.weight[1][lane])));
+		result = _mm_add_ps(result, _mm_mul_ps(_mm_load_ps(t10), _mm_set1_ps(cells.weight[2][lane])));
+		lanes[lane] = _mm_add_ps(result, _mm_mul_ps(_mm_load_ps(t10 + texelFloats), _mm_set1_ps(cells.weight[3][lane])));
+	}
+	_MM_TRANSPOSE4_PS(lanes[0], lanes[1], lanes[2], lanes[3]);
+	outX = lanes[0];
+	outY = lanes[1];
+	outZ = lanes[2];
+}
+
+// Four points at a time in the lanes of SSE registers. Locating cells and tracing back are done across the four;
+// the texel fetches are per point, but each fetches a whole group of components with one load.
+void CWaveGrid::QuerySurfaceRange(int begin, int end, const float* x, const float* z, float* height, CVector3* normal, CVector3* velocity)
+{
+	const CVector3 origin = mWaterGridModel->Position();
+	const int texelFloats = sizeof(QueryTexel) / sizeof(float);
+	const QueryTexel* texels = mQuerySource ? mQuerySource->data() : mQueryTexels.data();
+	const float* displacements = texels->displacement;
+	const float* normals = texels->normal;
+	const float* velocities = texels->velocity;
+
+	QueryGrid grid;
+	grid.toGrid = _mm_set1_ps(mSize / mLength);
+	grid.centre = _mm_set1_ps(mSize / 2.0f);
+	grid.size = _mm_set1_ps(static_cast<float>(mSize));
+	grid.inverseSize = _mm_set1_ps(1.0f / mSize);
+	grid.lastCell = _mm_set1_ps(static_cast<float>(mSize - 1));
+	grid.pitch = _mm_set1_ps(static_cast<float>(mSizePlus1));
+
+	QueryCells cells;
+	__m128 localX, localZ, restX, restZ, dX, dY, dZ, inverseLength;
+	alignas(16) float inX[4], inZ[4], outX[4], outY[4], outZ[4];
+	int lanes;
+
+	for (int n = begin; n < end; n += 4) {
+		// a short last batch repeats its last point in the spare lanes
+		lanes = std::min(4, end - n);
+		for (int lane = 0; lane < 4; lane++) {
+			inX[lane] = x[n + std::min(lane, lanes - 1)];
+			inZ[lane] = z[n + std::min(lane, lanes - 1)];
+		}
+		localX = _mm_sub_ps(_mm_load_ps(inX), _mm_set1_ps(origin.x));
+		localZ = _mm_sub_ps(_mm_load_ps(inZ), _mm_set1_ps(origin.z));
+
+		// The vertex that ends up at local started at local - displacement(start)
+		restX = localX;
+		restZ = localZ;
+		for (int iteration = 0; iteration < QUERY_ITERATIONS; iteration++) {
+			LocateQueryCells(grid, restX, restZ, cells);
+			BlendQueryGroup(displacements, texelFloats, mSizePlus1, cells, dX, dY, dZ);
+			restX = _mm_sub_ps(localX, dX);
+			restZ = _mm_sub_ps(localZ, dZ);
+		}
+
+		LocateQueryCells(grid, restX, restZ, cells);
+		BlendQueryGroup(displacements, texelFloats, mSizePlus1, cells, dX, dY, dZ);
+		_mm_store_ps(outY, _mm_add_ps(dY, _mm_set1_ps(origin.y)));
+		for (int lane = 0; lane < lanes; lane++) height[n + lane] = outY[lane];
+
+		if (normal) {
+			BlendQueryGroup(normals, texelFloats, mSizePlus1, cells, dX, dY, dZ);
+			inverseLength = _mm_div_ps(_mm_set1_ps(1.0f),
+			                           _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dX, dX), _mm_mul_ps(dY, dY)), _mm_mul_ps(dZ, dZ))));
+			_mm_store_ps(outX, _mm_mul_ps(dX, inverseLength));
+			_mm_store_ps(outY, _mm_mul_ps(dY, inverseLength));
+			_mm_store_ps(outZ, _mm_mul_ps(dZ, inverseLength));
+			for (int lane = 0; lane < lanes; lane++) normal[n + lane] = CVector3(outX[lane], outY[lane], outZ[lane]);
+		}
+		if (velocity) {
+			BlendQueryGroup(velocities, texelFloats, mSizePlus1, cells, dX, dY, dZ);
+			_mm_store_ps(outX, dX);
+			_mm_store_ps(outY, dY);
+			_mm_store_ps(outZ, dZ);
+			for (int lane = 0; lane < lanes; lane++) velocity[n + lane] = CVector3(outX[lane], outY[lane], outZ[lane]);
 		}
 	}
-	mWaterGridMesh->UpdateNodeVertexBuffer(0, mSize, vertexPositions, vertexNormals);
 }
 
 CVector2 CWaveGrid::Mult(CVector2 x, CVector2 y)
@@ -316,17 +1843,17 @@ CVector2 CWaveGrid::Mult(CVector2 x, CVector2 y)
 	return CVector2(x.x * y.x - x.y * y.y, x.x * y.y + x.y * y.x);
 }
 
-complex_type CWaveGrid::Mult(complex_type x, CVector2 y)
+wave_complex CWaveGrid::Mult(wave_complex x, CVector2 y)
 {
-	return complex_type(x._Val[0] * y.x - x._Val[1] * y.y, x._Val[0] * y.y + x._Val[1] * y.x);
+	return wave_complex(x._Val[0] * y.x - x._Val[1] * y.y, x._Val[0] * y.y + x._Val[1] * y.x);
 }
 
-complex_type CWaveGrid::Mult(complex_type x, complex_type y)
+wave_complex CWaveGrid::Mult(wave_complex x, wave_complex y)
 {
-	return complex_type(x._Val[0] * y._Val[0] - x._Val[1] * y._Val[1], x._Val[0] * y._Val[1] + x._Val[1] * y._Val[0]);
+	return wave_complex(x._Val[0] * y._Val[0] - x._Val[1] * y._Val[1], x._Val[0] * y._Val[1] + x._Val[1] * y._Val[0]);
 }
 
-float CWaveGrid::Dot(complex_type x, CVector2 y)
+float CWaveGrid::Dot(wave_complex x, CVector2 y)
 {
 	return x._Val[0] * y.x + x._Val[1] * y.y;
 }
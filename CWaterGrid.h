@@ -1,19 +1,29 @@
 #include "CVector2.h"
 #include "simple_fft\fft_settings.h"
+#include "simple_fft\fft_plan.hpp"
 #include "CVector3.h"
 #include "Mesh.h"
 #include "Model.h"
+#include "ThreadPool.h"
+#include "AlignedAllocator.h"
+#include "WaterVertexSink.h"
+#include "MappedFile.h"
+#include "InteractiveWaves.h"
+#include <memory>
+#include <string>
+#include <map>
+#include <cfloat>
 
-struct WaterGridVertex {
-	CVector3 vertex = { 0.0f, 0.0f, 0.0f };
-	CVector3 normal = { 0.0f, 0.0f, 0.0f };
-	CVector3 tilde = { 0.0f, 0.0f, 0.0f };
-	CVector3 tildeConj = { 0.0f, 0.0f, 0.0f };
-	CVector3 originalPos = { 0.0f, 0.0f, 0.0f };
-};
+// The ocean runs in single precision; define WATER_SIM_DOUBLE_PRECISION to validate it against a double build.
+#ifdef WATER_SIM_DOUBLE_PRECISION
+typedef double wave_real;
+#else
+typedef float wave_real;
+#endif
+typedef std::complex<wave_real> wave_complex;
 
 struct WaterGridNode {
-	complex_type height = { 0.0f, 0.0f };
+	wave_complex height = { 0.0f, 0.0f };
 	CVector2 displacementVector = { 0.0f, 0.0f };
 	CVector3 normal = { 0.0f, 0.0f, 0.0f };
 };
@@ -22,31 +32,328 @@ struct WaterGridNode {
 class CWaveGrid 
 {
 public:
-	CWaveGrid(const int size, const float phillips, const CVector2 wind, const float length);
+	// Smallest size the grid takes, as the amortised blend works on four vertices of a row at a time
+	static const int MIN_SIZE = 4;
+
+	// Nothing here but QuerySurface may be called while a frame is being evaluated, e.g. while a WaveSimulationThread
+	// runs the grid
+	// The same seed always gives the same ocean.
+	// With numCascades > 1 (up to MAX_CASCADES) the surface also carries longer waves from patches cascadeRatio,
+	// cascadeRatio^2... times the length of the grid, so it stops visibly repeating. Every cascade is band-limited so
+	// each wavelength comes from exactly one of them, and all are transformed together in one batch.
+	CWaveGrid(const int size, const float phillips, const CVector2 wind, const float length, const uint32_t seed = 0,
+	          const int numCascades = 1, const float cascadeRatio = 4.0f);
 	~CWaveGrid();
+	// The single wave functions describe the first cascade (the grid's own patch), including its band limit
 	float Dispersion(int gridY, int gridX);
 	float Phillips(int gridY, int gridX);
-	complex_type Tilde0(int gridY, int gridX);
-	complex_type Tilde(float t, int gridY, int gridX);
+	wave_complex Tilde0(int gridY, int gridX);
+	wave_complex Tilde(float t, int gridY, int gridX);
 	WaterGridNode HDN(CVector2 x, float t);
 	void WavesEvaluationFFT(float t);
 	void WavesEvaluation(float t);
+
+	// Cheaper stand-in for WavesEvaluationFFT, for low-end machines and distant tiles. Only the numWaves largest waves
+	// of the spectrum (by h0, over every cascade) are kept, and each vertex sums them directly as Gerstner waves, four
+	// at a time with SSE. The outputs are the same - vertices, Jacobian, foam and the query texels - so the two can be
+	// swapped from one frame to the next. Cost grows linearly with numWaves, and with every wave kept the surface is
+	// that of WavesEvaluationFFT (coarser cascades exactly, rather than interpolated). The default is 64 waves.
+	void SetGerstnerWaveCount(int numWaves);
+	int GerstnerWaveCount() const { return mGerstnerWaveCount; }
+	void WavesEvaluationGerstner(float t);
+
+	// Temporal amortisation: the FFT is solved only at multiples of 1 / solvesPerSecond (30 by default) and the frames
+	// in between are splined from the four keyframes around them
+	void SetAmortisedRate(float solvesPerSecond);
+	float AmortisedRate() const { return 1.0f / mKeyframeInterval; }
+	void WavesEvaluationAmortised(float t);
+
+	// Staggered bands: WavesEvaluationFFT transforms the second cascade refreshesPerSecond times a second and the
+	// coarser ones less often still, blending between solves. Zero, the default, transforms every cascade every frame
+	void SetBandRefreshRate(float refreshesPerSecond);
+	float BandRefreshRate() const { return mBandInterval > 0.0f ? 1.0f / mBandInterval : 0.0f; }
+
+	// Shallow water: depths below the rest surface, in metres, at resolution x resolution points from the first vertex
+	// to the last in vertex order; empty is deep water. Call before ReserveResolution. Throws a std::runtime_error if
+	// depths does not hold resolution^2 values
+	void SetBathymetry(const std::vector<float>& depths, int resolution);
+	bool HasBathymetry() const { return !mBathymetry.empty(); }
+
+	// Where the vertices of each frame go. By default the grid mesh, which is also what nullptr restores
+	void SetVertexSink(WaterVertexSink* sink);
+
+	// Ripples added to the emitted vertices only, not the maps or QuerySurface; nullptr, the default, adds none. They
+	// must not be updated while a frame is being evaluated, so a WaveSimulationThread takes them over and adds them as
+	// it uploads
+	void SetInteractiveWaves(const InteractiveWaves* waves) { mInteractiveWaves = waves; }
+	const InteractiveWaves* GetInteractiveWaves() const { return mInteractiveWaves; }
+
+	// Weather, taking effect at the next evaluation. A new length also unloads any baked animation
+	void SetWind(const CVector2 wind);
+	void SetAmplitude(const float phillips);
+	void SetLength(const float length);
+	CVector2 Wind() const { return mWind; }
+	float Amplitude() const { return mPhillipsParameter; }
+	float Length() const { return mLength; }
+
+	// Resolution: size x size (a power of two) with numCascades cascades, dropping the last frame, foam and any baked
+	// animation of another size. Throws a std::runtime_error for a size under 4 or that the FFT cannot take, or for too
+	// many cascades
+	void SetResolution(const int size, const int numCascades);
+	// Builds the meshes for every size from minSize to maxSize and room for maxSize and maxCascades at the current length
+	void ReserveResolution(const int minSize, const int maxSize, const int maxCascades);
+	int Size() const { return mSize; }
+	int NumCascades() const { return mNumCascades; }
+
+	// Level of detail. SetLodCount(n) keeps a chain of n more grids, of size N/2, N/4 and so on down to MIN_LOD_SIZE,
+	// over the same patch with the same cascades, seed and weather. Each transforms only the middle of the spectrum,
+	// the waves its own grid can carry, so a level costs about a quarter of the one before and does not alias as
+	// sampling the full grid more sparsely would. The draws behind h0 are keyed by the wave, so every level has the
+	// same waves as this grid, short of the shortest; the one exception is where a level's coarser cascades can no
+	// longer hold the bottom of this grid's finer bands, which it then carries in its finer cascade with that
+	// cascade's draws. Each level is a CWaveGrid of its own, with its own model, mesh, vertex sink, maps and
+	// QuerySurface, so it can be drawn or queried without the full grid; it follows this grid's weather and resolution
+	// (call ReserveResolution after SetLodCount to cover the levels too) and shares its threads, so must be evaluated
+	// on the same thread. Lod(0) is this grid.
+	void SetLodCount(int count);
+	int LodCount() const { return static_cast<int>(mLods.size()); }
+	CWaveGrid& Lod(int level) { return level == 0 ? *this : *mLods[level - 1]; }
+	// Runs WavesEvaluationFFT on every level after the first
+	void WavesEvaluationLods(float t);
+
+	// Baked playback. The surface repeats every REPEAT_TIME seconds, so one period sampled at framesPerSecond can be
+	// stored once and replayed indefinitely, interpolating between frames, for the cost of streaming it from disk.
+	// BakeAnimation evaluates the whole period with WavesEvaluationFFT and writes it to fileName (the vertex sink is
+	// not touched). LoadBakedAnimation maps a file baked by a grid of the same size and length; both throw a
+	// std::runtime_error on failure. WavesPlayback then replaces WavesEvaluationFFT.
+	void BakeAnimation(const std::string& fileName, float framesPerSecond);
+	void LoadBakedAnimation(const std::string& fileName);
+	void UnloadBakedAnimation();
+	bool HasBakedAnimation() const { return mBakedAnimation != nullptr; }
+	void WavesPlayback(float t);
+
+	// Whitecaps. The Jacobian of the horizontal displacement is 1 where the surface is undistorted and falls to 0 and
+	// below where it is squeezed together and folds over, at wave crests. Foam is the coverage that implies, from 0 to 1,
+	// fading out over FOAM_DECAY_TIME once the crest has passed. Both maps hold mSizePlus1 x mSizePlus1 values in
+	// vertex order. WavesEvaluationFFT and its stand-ins update both; WavesPlayback updates the foam from the baked
+	// animation.
+	const AlignedVector<float>& JacobianMap() const { return mJacobian; }
+	const AlignedVector<float>& FoamMap() const { return mFoam; }
+
+	// Surface at many points at once, for gameplay and physics. x and z are world positions (the grid model is taken
+	// to be unrotated and unscaled); points off the tile are wrapped onto it, which is exact for a single cascade.
+	// Since vertices move sideways, each point is first traced back to the rest position that ends up there with
+	// QUERY_ITERATIONS fixed-point steps, which settle wherever the surface does not fold over. Height (in world
+	// space), unit normal and the velocity of the water are then interpolated bilinearly from the last frame of
+	// whichever evaluation ran; velocity is the change since the frame before, zero on the first frame or after a
+	// jump back in time (WavesEvaluationAmortised gives the spline's own instead). normal and velocity may be null.
+	// While a WaveSimulationThread runs the grid this is the one call allowed, and reads the frame on screen.
+	void QuerySurface(int count, const float* x, const float* z, float* height, CVector3* normal = nullptr, CVector3* velocity = nullptr);
+
+	// Everything QuerySurface reads about one vertex in three aligned groups of four (x, y, z, unused), so that one
+	// SIMD load fetches a group and one multiply-add per sample blends it. Displacement is from the rest position.
+	struct QueryTexel {
+		float displacement[4];
+		float normal[4];
+		float velocity[4];
+	};
+	// The texels of the last frame evaluated, mSizePlus1 x mSizePlus1 in vertex order. SetQueryTexels has
+	// QuerySurface read a copy of them instead, until nullptr puts the grid's own back
+	const AlignedVector<QueryTexel>& QueryTexels() const { return mQueryTexels; }
+	void SetQueryTexels(const AlignedVector<QueryTexel>* texels) { mQuerySource = texels; }
+
+	// The threads the grid's loops are split between, shared with its levels of detail
+	ThreadPool& Threads() { return mThreadPool; }
 	Mesh* mWaterGridMesh;
 	Model* mWaterGridModel;
 
 private:
+	// A level of detail of parent, sharing its threads
+	CWaveGrid(CWaveGrid& parent, int size);
+	void UpdateLods();
 	CVector2 Mult(CVector2 x, CVector2 y);
-	complex_type Mult(complex_type x, CVector2 y);
-	complex_type Mult(complex_type x, complex_type y);
-	float Dot(complex_type x, CVector2 y);
+	wave_complex Mult(wave_complex x, CVector2 y);
+	wave_complex Mult(wave_complex x, wave_complex y);
+	float Dot(wave_complex x, CVector2 y);
 	float Dot(CVector2 x, CVector2 y);
+	int DispersionStep(int gridY, int gridX, int cascade = 0, float depth = FLT_MAX);
+	float Phillips(int gridY, int gridX, int cascade);
+	wave_complex Tilde0(int gridY, int gridX, int cascade);
+	bool InBand(int gridY, int gridX, int cascade);
+	void UpdateCascadeBands();
+	void UpdateWaveTables();
+	void UpdateTilde0();
+	void ApplySpectrumChanges();
+	Mesh* GridMesh(const int size);
+	void UpdatePhaseSteps(float t, std::vector<wave_complex>& steps);
+	void SolveCascades(int count, const int* cascades, const float* times, const AlignedVector<int>& dispersionStep);
+	void InverseFFT2DFields(int count, const int* cascades);
+	// Every real field of the surface at one vertex, before displacement and normalisation
+	struct SurfaceSample {
+		float height, slopeX, slopeZ, dX, dZ, dXdX, dZdZ, dXdZ;
+	};
+	void AddCascade(const AlignedVector<wave_complex>& spectrum, int cascade, int row, int column, float weight, SurfaceSample& sample);
+	void UpdateVertexDepths();
+	void SolveDepthBands(float t);
+	void AddDepthBand(int band, float weight, int row, int column, SurfaceSample& sample);
+	int StaggerBands(float t, int* cascades, float* times);
+	void StoreBand(int cascade, int slot);
+	void BlendBand(int cascade, float t);
+	void ClearBands();
+	float BandInterval(int cascade) const { return mBandInterval * pow(sqrt(mCascadeRatio), static_cast<float>(cascade - 1)); }
+	float BandTime(int cascade, int index) const { return mBandInterval * (cascade - 1) / (mNumCascades - 1) + index * BandInterval(cascade); }
+	void AdvanceFrameTime(float t, float& foamFade, float& inverseTimeStep);
+	void ResolveVertex(int row, int column, const SurfaceSample& sample, float foamFade, float inverseTimeStep);
+	void SelectGerstnerWaves();
+	struct Keyframe;
+	void SolveKeyframe(int index);
+	void ClearKeyframes();
+	static int KeyframeSlot(int index) { return (index % KEYFRAME_COUNT + KEYFRAME_COUNT) % KEYFRAME_COUNT; }
+	void StoreQueryTexel(int j, float dX, float height, float dZ, float normalX, float normalY, float normalZ, float inverseTimeStep);
+	void QuerySurfaceRange(int begin, int end, const float* x, const float* z, float* height, CVector3* normal, CVector3* velocity);
+	void WrapRow(int gridX);
+	void WrapLastRow();
+	void EmitRow(WaterGridVertex* vertices, int gridX);
+	const unsigned char* BakedFrame(int frame) const;
 
 	const float GRAVITY = 9.81f;
+	// Every frequency is a whole multiple of 2 pi / REPEAT_TIME, so the surface repeats after REPEAT_TIME seconds
+	const float REPEAT_TIME = 200.0f;
+	static const int MAX_CASCADES = 4;
+	static const int MIN_LOD_SIZE = 4;
+	static const int DEPTH_BANDS = 6;
+	const float SHALLOWEST_DEPTH = 1.0f;
+	// The Jacobian at which foam starts to appear (reaching full coverage at 0), and the time it takes to fade to 1/e
+	const float FOAM_THRESHOLD = 0.4f;
+	const float FOAM_DECAY_TIME = 2.0f;
+	const int QUERY_ITERATIONS = 3;
 	int mSize, mSizePlus1;
+	int mNumCascades;
+	float mCascadeRatio;
+	std::vector<float> mCascadeLength;				// patch length of each cascade, the first being mLength
+	std::vector<float> mBandLow, mBandHigh;			// each cascade keeps the waves with mBandLow <= |k| < mBandHigh
 	float mPhillipsParameter;
 	CVector2 mWind;
 	float mLength;
-	std::vector<complex_type> mTilde, mTildeSlopeX, mTildeSlopeZ, mTildeDX, mTildeDZ;
-	WaterGridVertex* mWaterGrid;
+	uint32_t mSeed;
+	// Every spectral field is Hermitian, so its inverse transform is real and two of them share one complex
+	// transform as re + i*im. The packed fields sit side by side in each row of mSpectrum: row r holds
+	// FIELD_COUNT runs of mSize values for each cascade in turn, so one strided batch covers all of them. The spectrum is stored
+	// transposed (row gridY, column gridX) so that the transposed output of InverseFFT2DFields comes out
+	// in vertex order, row gridX, column gridY.
+	enum SpectrumField {
+		FIELD_HEIGHT_SLOPE_X = 0,
+		FIELD_SLOPE_Z_DX,
+		FIELD_DZ_DXDX,			// dZ + i * dDx/dx
+		FIELD_DZDZ_DXDZ,		// dDz/dz + i * dDx/dz
+		FIELD_COUNT
+	};
+	// Static state, rebuilt only when the weather changes (see ApplySpectrumChanges). Wave-vector tables are indexed
+	// gridY * mSize + gridX like the spectrum rows, and the per-cascade ones hold a block of mSize x mSize entries
+	// (mSize for mWaveNumber) for each cascade in turn
+	std::vector<float> mWaveNumber;					// k along either axis for grid index n, pi * (2n - N) / L
+	AlignedVector<float> mKUnitX, mKUnitZ;			// k / |k|, zero at k = 0; the same for every cascade
+	AlignedVector<wave_complex> mGaussian;			// the two Gaussian draws behind h0(k)
+	AlignedVector<int> mDispersionStep;				// omega(k) in steps of 2 pi / REPEAT_TIME
+	AlignedVector<wave_complex> mTilde0;			// h0(k), zero outside the cascade's band
+	AlignedVector<wave_complex> mTilde0Conj;		// conj(h0(-k))
+	std::vector<float> mRestX, mRestZ;				// undisplaced vertex position along each axis, mSizePlus1 entries
+	// Set by SetWind, SetAmplitude and SetLength for ApplySpectrumChanges
+	bool mWaveTablesStale;							// mRestX/Z, mWaveNumber and mDispersionStep need the new length
+	bool mTilde0Stale;								// h0 needs refilling from the new spectrum
+	float mTilde0Amplitude;							// mPhillipsParameter that h0 was made with
+
+	// Where the vertices along one axis sample a coarser cascade: two neighbouring samples and their bilinear
+	// weights, with the (-1)^n sign of the transform folded in. mSizePlus1 entries for each cascade after the first
+	struct CascadeTap {
+		int index0, index1;
+		float weight0, weight1;
+	};
+	std::vector<CascadeTap> mCascadeTaps;
+
+	// Per-frame state. Vertex arrays hold mSizePlus1 x mSizePlus1 entries, indexed gridX * mSizePlus1 + gridY;
+	// the last row and column lie one tile length on from the first so neighbouring tiles meet seamlessly
+	// exp(i * m * 2 pi t / REPEAT_TIME) for every step m in use, rebuilt once per frame by UpdatePhaseSteps
+	std::vector<wave_complex> mPhaseSteps;
+	std::vector<wave_complex> mBandPhaseSteps[MAX_CASCADES];	// the same for the other times solved in one pass
+	AlignedVector<wave_complex> mSpectrum;
+	int mSpectrumPitch;
+	AlignedVector<float> mPositionX, mPositionY, mPositionZ;
+	AlignedVector<float> mNormalX, mNormalY, mNormalZ;
+	AlignedVector<float> mJacobian, mFoam;
+	float mFoamTime;								// time of the frame mFoam was last updated for
+
+	AlignedVector<QueryTexel> mQueryTexels;
+	float mQueryTime;								// time of the frame in mQueryTexels
+	const AlignedVector<QueryTexel>* mQuerySource;	// read by QuerySurface in place of mQueryTexels, or null
+
+	// The waves WavesEvaluationGerstner sums, largest first and padded with silent waves to a multiple of four. Each
+	// is 2 h0(k) exp(i (k.x + omega t)): summed over every k that gives the surface, as k and -k together make the
+	// real wave. Every field is the real or imaginary part of that times a real factor held here
+	struct GerstnerWaves {
+		AlignedVector<float> amplitudeRe, amplitudeIm;	// 2 h0(k)
+		AlignedVector<float> kX, kZ;					// slopes are -k times the imaginary part
+		AlignedVector<float> unitX, unitZ;				// displacements are k / |k| times the imaginary part
+		AlignedVector<float> kXUnitX, kZUnitZ, kZUnitX;	// their derivatives are these times the real part
+		AlignedVector<float> stepRe, stepIm;			// exp(i kX dx), from one vertex to the next along a row
+		AlignedVector<float> rowStepRe, rowStepIm;		// exp(i kZ dz), from one row to the next
+		std::vector<int> dispersionStep;
+		AlignedVector<float> baseRe, baseIm;			// 2 h0 exp(i omega t), this frame's waves at x = 0
+		AlignedVector<float> scratch;					// four rows of phases for each thread
+	};
+	GerstnerWaves mGerstner;
+	int mGerstnerWaveCount;
+	bool mGerstnerStale;							// mGerstner needs choosing again from h0
+
+	// The vertex arrays WavesEvaluationFFT left for time index * mKeyframeInterval
+	struct Keyframe {
+		int index;									// INT_MIN when empty
+		AlignedVector<float> positionX, positionY, positionZ;
+		AlignedVector<float> normalX, normalY, normalZ;
+		AlignedVector<float> jacobian, foam;
+	};
+	static const int KEYFRAME_COUNT = 4;
+	Keyframe mKeyframes[KEYFRAME_COUNT];			// in KeyframeSlot(index)
+	float mKeyframeInterval;
+	CpuVertexSink mKeyframeSink;					// takes the vertices of keyframe solves, which are not shown
+
+	// Staggered bands: the last two solves of each coarser cascade, at band times index[0] and index[1] = index[0] + 1,
+	// laid out as its part of mSpectrum but with a pitch of FIELD_COUNT * mSize
+	struct Band {
+		int index[2];								// INT_MIN when empty
+		AlignedVector<wave_complex> fields[2];
+	};
+	Band mBands[MAX_CASCADES];						// the first unused
+	float mBandInterval;							// between refreshes of the second cascade, zero when not staggered
+
+	// Shallow water: the map as given, and for each depth band the frequencies and the solve of the spectrum there
+	std::vector<float> mBathymetry;
+	int mBathymetryResolution;
+	struct DepthBand {
+		AlignedVector<int> dispersionStep;			// as mDispersionStep, at the band's depth
+		bool differs[MAX_CASCADES];					// whether any wave of the cascade moves differently from deep water
+		bool used;									// whether any vertex takes from the band
+		AlignedVector<wave_complex> spectrum;		// laid out as mSpectrum, holding only the cascades that differ
+	};
+	DepthBand mDepthBands[DEPTH_BANDS];
+	std::vector<unsigned char> mVertexDepthBand;	// per vertex, the shallower of the bands it blends, DEPTH_BANDS for deep water
+	AlignedVector<float> mVertexDepthWeight;		// and the weight of the band after it
+
+	simple_fft::BasicFFTPlan<wave_real> mFFTPlan;
+	std::unique_ptr<ThreadPool> mOwnThreadPool;		// null for a level of detail, which uses its parent's
+	ThreadPool& mThreadPool;
+	CWaveGrid* mLodParent;							// the grid this is a level of detail of, or null
+	int mLodRequest;								// levels asked for, of which as many as the size allows are made
+	std::vector<std::unique_ptr<CWaveGrid>> mLods;
+	std::map<int, Mesh*> mGridMeshes;				// by size, mWaterGridMesh among them
+	std::map<int, MeshVertexSink*> mMeshSinks;		// one for each of mGridMeshes
+	MeshVertexSink* mMeshSink;						// mWaterGridMesh's
+	WaterVertexSink* mVertexSink;
+	const InteractiveWaves* mInteractiveWaves;
+
+	// Baked animation, when loaded: mBakedFrames frames evenly spread over REPEAT_TIME, mBakedFrameStride bytes apart
+	std::unique_ptr<MappedFile> mBakedAnimation;
+	int mBakedFrames;
+	size_t mBakedFrameStride;
 };
 
@@ -0,0 +1,377 @@
+//--------------------------------------------------------------------------------------
+// Ripples from objects in the water, on top of the ocean of a CWaveGrid
+//--------------------------------------------------------------------------------------
+
+#include "InteractiveWaves.h"
+#include "MathHelpers.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <emmintrin.h>
+
+// Solves the n x n system a x = b in place by Gaussian elimination with partial pivoting, leaving x in b
+static void Solve(std::vector<double>& a, std::vector<double>& b, int n)
+{
+	for (int column = 0; column < n; ++column)
+	{
+		int pivot = column;
+		for (int row = column + 1; row < n; ++row)
+		{
+			if (std::abs(a[row * n + column]) > std::abs(a[pivot * n + column]))  pivot = row;
+		}
+		for (int k = 0; k < n; ++k)  std::swap(a[column * n + k], a[pivot * n + k]);
+		std::swap(b[column], b[pivot]);
+		for (int row = column + 1; row < n; ++row)
+		{
+			const double factor = a[row * n + column] / a[column * n + column];
+			for (int k = column; k < n; ++k)  a[row * n + k] -= factor * a[column * n + k];
+			b[row] -= factor * b[column];
+		}
+	}
+	for (int row = n - 1; row >= 0; --row)
+	{
+		for (int k = row + 1; k < n; ++k)  b[row] -= a[row * n + k] * b[k];
+		b[row] /= a[row * n + row];
+	}
+}
+
+
+InteractiveWaves::InteractiveWaves(ThreadPool& threadPool, CVector2 centre, float size, float cellSize, float timeStep)
+	: mThreadPool(threadPool), mCellSize(cellSize), mTimeStep(timeStep), mAccumulator(0), mLastUpdateTime(0), mAwakeCount(0)
+{
+	mTilesX = std::max(static_cast<int>(std::ceil(size / (cellSize * TILE_SIZE))), 1);
+	mCells = mTilesX * TILE_SIZE;
+	mOrigin = CVector2(centre.x - mCells * cellSize / 2, centre.y - mCells * cellSize / 2);
+
+	mTiles.resize(mTilesX * mTilesX);
+	for (Tile& tile : mTiles)
+	{
+		tile.height.assign(TILE_SIZE * TILE_SIZE, 0.0f);
+		tile.previous.assign(TILE_SIZE * TILE_SIZE, 0.0f);
+		tile.padded.assign(PADDED_SIZE * PADDED_SIZE, 0.0f);
+		tile.awake = false;
+		tile.wake = false;
+	}
+	mAwake.reserve(mTiles.size());
+
+	// The vertical derivative multiplies each wave by |k| (in radians per cell here). No kernel of KERNEL_RADIUS cells
+	// does that exactly, |k| having a kink at 0, so the weights off the centre are fitted to it by least squares over
+	// the waves the cells can hold, and the centre is whatever makes the kernel sum to zero, so still water stays
+	// still. By symmetry there is one weight for each offset (z, x) with 0 <= z <= x, standing for all its mirror
+	// images; wave (kX, kZ) sees it as the sum of cos(kX x' + kZ z') over the images, less one for each from the centre
+	std::vector<int> offsetZ, offsetX;
+	for (int z = 0; z <= KERNEL_RADIUS; ++z)
+	{
+		for (int x = std::max(z, 1); x <= KERNEL_RADIUS; ++x)
+		{
+			offsetZ.push_back(z);
+			offsetX.push_back(x);
+		}
+	}
+	const int unknowns = static_cast<int>(offsetZ.size());
+	const int samples = 48;
+	std::vector<double> normal(unknowns * unknowns, 0.0), target(unknowns, 0.0), basis(unknowns);
+	for (int sampleZ = 0; sampleZ <= samples; ++sampleZ)
+	{
+		for (int sampleX = 0; sampleX <= samples; ++sampleX)
+		{
+			const double kX = PI * sampleX / samples, kZ = PI * sampleZ / samples;
+			for (int j = 0; j < unknowns; ++j)
+			{
+				const int z = offsetZ[j], x = offsetX[j];
+				if (z == 0)       basis[j] = 2 * std::cos(kX * x) + 2 * std::cos(kZ * x) - 4;
+				else if (z == x)  basis[j] = 4 * std::cos(kX * x) * std::cos(kZ * z) - 4;
+				else              basis[j] = 4 * std::cos(kX * x) * std::cos(kZ * z) + 4 * std::cos(kX * z) * std::cos(kZ * x) - 8;
+			}
+			const double kLength = std::sqrt(kX * kX + kZ * kZ);
+			for (int j = 0; j < unknowns; ++j)
+			{
+				for (int i = 0; i < unknowns; ++i)  normal[j * unknowns + i] += basis[j] * basis[i];
+				target[j] += basis[j] * kLength;
+			}
+		}
+	}
+	Solve(normal, target, unknowns);
+
+	mKernel[0][0] = 0;
+	for (int j = 0; j < unknowns; ++j)
+	{
+		const int z = offsetZ[j], x = offsetX[j];
+		mKernel[z][x] = mKernel[x][z] = static_cast<float>(target[j]);
+		const int images = z == 0 || z == x ? 4 : 8;
+		mKernel[0][0] -= static_cast<float>(target[j] * images);
+	}
+}
+
+
+void InteractiveWaves::Displace(float x, float z, float radius, float volume)
+{
+	radius = std::max(radius, mCellSize);
+	const float u = (x - mOrigin.x) / mCellSize - 0.5f;
+	const float v = (z - mOrigin.y) / mCellSize - 0.5f;
+	const float cellRadius = radius / mCellSize;
+	const int firstX = std::max(static_cast<int>(std::ceil(u - cellRadius)), 0);
+	const int lastX = std::min(static_cast<int>(std::floor(u + cellRadius)), mCells - 1);
+	const int firstZ = std::max(static_cast<int>(std::ceil(v - cellRadius)), 0);
+	const int lastZ = std::min(static_cast<int>(std::floor(v + cellRadius)), mCells - 1);
+	if (firstX > lastX || firstZ > lastZ)  return;
+
+	// A raised cosine over the disc, scaled so the cells on the area lose exactly the volume between them. The last
+	// step's heights are lowered as well, so the water is moved without being set in motion; the kernel then spreads
+	// the dip out as ripples. Lowering only the heights would also give the whole area a downward speed that nothing
+	// restores, and it would keep sinking until the damping stopped it
+	auto weight = [&](int cellX, int cellZ)
+	{
+		const float distance = std::sqrt((cellX - u) * (cellX - u) + (cellZ - v) * (cellZ - v)) / cellRadius;
+		return distance < 1.0f ? 0.5f + 0.5f * std::cos(PI * distance) : 0.0f;
+	};
+	float total = 0;
+	for (int cellZ = firstZ; cellZ <= lastZ; ++cellZ)
+	{
+		for (int cellX = firstX; cellX <= lastX; ++cellX)  total += weight(cellX, cellZ);
+	}
+	if (total <= 0)  return;
+
+	const float scale = volume / (total * mCellSize * mCellSize);
+	for (int cellZ = firstZ; cellZ <= lastZ; ++cellZ)
+	{
+		for (int cellX = firstX; cellX <= lastX; ++cellX)
+		{
+			Tile& tile = mTiles[(cellZ / TILE_SIZE) * mTilesX + cellX / TILE_SIZE];
+			const int cell = (cellZ % TILE_SIZE) * TILE_SIZE + cellX % TILE_SIZE;
+			const float depth = weight(cellX, cellZ) * scale;
+			tile.height[cell] -= depth;
+			tile.previous[cell] -= depth;
+			tile.wake = true;
+		}
+	}
+}
+
+
+void InteractiveWaves::Update(float frameTime)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	mAccumulator += frameTime;
+	int steps = 0;
+	while (mAccumulator >= mTimeStep && steps < MAX_STEPS)
+	{
+		Step();
+		mAccumulator -= mTimeStep;
+		++steps;
+	}
+	mAccumulator = std::fmod(mAccumulator, mTimeStep);
+
+	mLastUpdateTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+void InteractiveWaves::Sample(float x, float z, float& height, float& slopeX, float& slopeZ) const
+{
+	const float u = (x - mOrigin.x) / mCellSize - 0.5f;
+	const float v = (z - mOrigin.y) / mCellSize - 0.5f;
+	const float baseX = std::floor(u), baseZ = std::floor(v);
+	const int cellX = static_cast<int>(baseX), cellZ = static_cast<int>(baseZ);
+	const float fractionX = u - baseX, fractionZ = v - baseZ;
+
+	const float h00 = CellHeight(cellX, cellZ),     h10 = CellHeight(cellX + 1, cellZ);
+	const float h01 = CellHeight(cellX, cellZ + 1), h11 = CellHeight(cellX + 1, cellZ + 1);
+	height = (h00 + (h10 - h00) * fractionX) * (1 - fractionZ) + (h01 + (h11 - h01) * fractionX) * fractionZ;
+	slopeX = ((h10 - h00) * (1 - fractionZ) + (h11 - h01) * fractionZ) / mCellSize;
+	slopeZ = ((h01 - h00) * (1 - fractionX) + (h11 - h10) * fractionX) / mCellSize;
+}
+
+
+// The normal is (-slopeX, 1, -slopeZ) normalised, so the wave's slopes come back from it as -normalX / normalY and
+// -normalZ / normalY, and the ripples' are added to those
+void InteractiveWaves::Lift(const CVector3& origin, CVector3& position, CVector3& normal) const
+{
+	float height, slopeX, slopeZ;
+	Sample(origin.x + position.x, origin.z + position.z, height, slopeX, slopeZ);
+	position.y += height;
+	const float inverseY = 1.0f / normal.y;
+	normal = Normalise(CVector3(normal.x * inverseY - slopeX, 1.0f, normal.z * inverseY - slopeZ));
+}
+
+
+float InteractiveWaves::CellHeight(int cellX, int cellZ) const
+{
+	if (cellX < 0 || cellZ < 0 || cellX >= mCells || cellZ >= mCells)  return 0;
+	const Tile& tile = mTiles[(cellZ / TILE_SIZE) * mTilesX + cellX / TILE_SIZE];
+	return tile.height[(cellZ % TILE_SIZE) * TILE_SIZE + cellX % TILE_SIZE];
+}
+
+
+// Every awake tile gathers its neighbourhood before any is stepped, so the result does not depend on the order or
+// the number of threads. Afterwards each tile stays awake while its ripples last, and wakes the neighbours they come
+// within reach of; the rest are zeroed and go to sleep
+void InteractiveWaves::Step()
+{
+	mAwake.clear();
+	for (int i = 0; i < static_cast<int>(mTiles.size()); ++i)
+	{
+		Tile& tile = mTiles[i];
+		if (tile.awake || tile.wake)  mAwake.push_back(i);
+		tile.awake = tile.awake || tile.wake;
+		tile.wake = false;
+	}
+	if (mAwake.empty())
+	{
+		mAwakeCount = 0;
+		return;
+	}
+
+	auto gatherTiles = [&](int begin, int end)
+	{
+		for (int n = begin; n < end; ++n)  Gather(mAwake[n] % mTilesX, mAwake[n] / mTilesX);
+	};
+	auto stepTiles = [&](int begin, int end)
+	{
+		for (int n = begin; n < end; ++n)  StepTile(mTiles[mAwake[n]]);
+	};
+	mThreadPool.ParallelFor(static_cast<int>(mAwake.size()), gatherTiles);
+	mThreadPool.ParallelFor(static_cast<int>(mAwake.size()), stepTiles);
+
+	for (int index : mAwake)
+	{
+		const Tile& tile = mTiles[index];
+		const int tileX = index % mTilesX, tileZ = index / mTilesX;
+		for (int zoneZ = 0; zoneZ < 3; ++zoneZ)
+		{
+			for (int zoneX = 0; zoneX < 3; ++zoneX)
+			{
+				if (tile.reach[zoneZ][zoneX] < SLEEP_HEIGHT)  continue;
+				// A zone by an edge or corner reaches the neighbours on that side as well as the tile itself
+				for (int z = std::min(zoneZ - 1, 0); z <= std::max(zoneZ - 1, 0); ++z)
+				{
+					for (int x = std::min(zoneX - 1, 0); x <= std::max(zoneX - 1, 0); ++x)
+					{
+						if (tileX + x < 0 || tileZ + z < 0 || tileX + x >= mTilesX || tileZ + z >= mTilesX)  continue;
+						mTiles[(tileZ + z) * mTilesX + tileX + x].wake = true;
+					}
+				}
+			}
+		}
+	}
+
+	mAwakeCount = 0;
+	for (int index : mAwake)
+	{
+		Tile& tile = mTiles[index];
+		if (tile.wake)
+		{
+			++mAwakeCount;
+			continue;
+		}
+		std::fill(tile.height.begin(), tile.height.end(), 0.0f);
+		std::fill(tile.previous.begin(), tile.previous.end(), 0.0f);
+		tile.awake = false;
+	}
+}
+
+
+void InteractiveWaves::Gather(int tileX, int tileZ)
+{
+	float* padded = mTiles[tileZ * mTilesX + tileX].padded.data();
+	for (int row = 0; row < PADDED_SIZE; ++row)
+	{
+		const int cellZ = tileZ * TILE_SIZE + row - KERNEL_RADIUS;
+		float* out = padded + row * PADDED_SIZE;
+
+		// Three runs along the row: the end of the left neighbour's, the tile's own and the start of the right one's
+		const int sourceX[3] = { tileX - 1, tileX, tileX + 1 };
+		const int first[3] = { TILE_SIZE - KERNEL_RADIUS, 0, 0 };
+		const int count[3] = { KERNEL_RADIUS, TILE_SIZE, KERNEL_RADIUS };
+		for (int run = 0; run < 3; ++run)
+		{
+			const Tile* source = nullptr;
+			if (cellZ >= 0 && cellZ < mCells && sourceX[run] >= 0 && sourceX[run] < mTilesX)
+			{
+				source = &mTiles[(cellZ / TILE_SIZE) * mTilesX + sourceX[run]];
+				if (!source->awake)  source = nullptr;
+			}
+			if (source)
+			{
+				const float* in = source->height.data() + (cellZ % TILE_SIZE) * TILE_SIZE + first[run];
+				std::copy(in, in + count[run], out);
+			}
+			else
+			{
+				std::fill(out, out + count[run], 0.0f);
+			}
+			out += count[run];
+		}
+	}
+}
+
+
+// h' = (h (2 - a dt) - h_prev - g dt^2 / cellSize * (G * h)) / (1 + a dt), four cells at a time. The kernel is
+// symmetric, so cells at the same offset either side are added before they are weighted. Movement, the larger of
+// |h'| and |h' - h|, is tracked for the zones within reach of the kernel of each edge, whole groups of four wide
+void InteractiveWaves::StepTile(Tile& tile)
+{
+	const float damping = 1.0f + DAMPING * mTimeStep;
+	const __m128 keep = _mm_set1_ps((2.0f - DAMPING * mTimeStep) / damping);
+	const __m128 forget = _mm_set1_ps(1.0f / damping);
+	const __m128 gravity = _mm_set1_ps(GRAVITY * mTimeStep * mTimeStep / (mCellSize * damping));
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const int edge = (KERNEL_RADIUS + 3) & ~3;
+
+	__m128 reach[3][3];
+	for (int zoneZ = 0; zoneZ < 3; ++zoneZ)
+	{
+		for (int zoneX = 0; zoneX < 3; ++zoneX)  reach[zoneZ][zoneX] = _mm_setzero_ps();
+	}
+
+	for (int z = 0; z < TILE_SIZE; ++z)
+	{
+		const float* centre = tile.padded.data() + (z + KERNEL_RADIUS) * PADDED_SIZE + KERNEL_RADIUS;
+		float* height = tile.height.data() + z * TILE_SIZE;
+		float* previous = tile.previous.data() + z * TILE_SIZE;
+		const int zoneZ = z < edge ? 0 : z >= TILE_SIZE - edge ? 2 : 1;
+
+		for (int x = 0; x < TILE_SIZE; x += 4)
+		{
+			const float* row = centre + x;
+			const __m128 current = _mm_loadu_ps(row);
+			__m128 sum = _mm_mul_ps(current, _mm_set1_ps(mKernel[0][0]));
+			for (int dx = 1; dx <= KERNEL_RADIUS; ++dx)
+			{
+				const __m128 pair = _mm_add_ps(_mm_loadu_ps(row + dx), _mm_loadu_ps(row - dx));
+				sum = _mm_add_ps(sum, _mm_mul_ps(pair, _mm_set1_ps(mKernel[0][dx])));
+			}
+			for (int dz = 1; dz <= KERNEL_RADIUS; ++dz)
+			{
+				const float* below = row - dz * PADDED_SIZE;
+				const float* above = row + dz * PADDED_SIZE;
+				__m128 pair = _mm_add_ps(_mm_loadu_ps(above), _mm_loadu_ps(below));
+				sum = _mm_add_ps(sum, _mm_mul_ps(pair, _mm_set1_ps(mKernel[dz][0])));
+				for (int dx = 1; dx <= KERNEL_RADIUS; ++dx)
+				{
+					pair = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(above + dx), _mm_loadu_ps(above - dx)),
+					                  _mm_add_ps(_mm_loadu_ps(below + dx), _mm_loadu_ps(below - dx)));
+					sum = _mm_add_ps(sum, _mm_mul_ps(pair, _mm_set1_ps(mKernel[dz][dx])));
+				}
+			}
+
+			const __m128 next = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(current, keep), _mm_mul_ps(_mm_load_ps(previous + x), forget)),
+			                               _mm_mul_ps(sum, gravity));
+			_mm_store_ps(previous + x, current);
+			_mm_store_ps(height + x, next);
+
+			const __m128 movement = _mm_max_ps(_mm_andnot_ps(signMask, next), _mm_andnot_ps(signMask, _mm_sub_ps(next, current)));
+			const int zoneX = x < edge ? 0 : x >= TILE_SIZE - edge ? 2 : 1;
+			reach[zoneZ][zoneX] = _mm_max_ps(reach[zoneZ][zoneX], movement);
+		}
+	}
+
+	for (int zoneZ = 0; zoneZ < 3; ++zoneZ)
+	{
+		for (int zoneX = 0; zoneX < 3; ++zoneX)
+		{
+			alignas(16) float lanes[4];
+			_mm_store_ps(lanes, reach[zoneZ][zoneX]);
+			tile.reach[zoneZ][zoneX] = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+		}
+	}
+}
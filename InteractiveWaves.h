@@ -0,0 +1,112 @@
+//--------------------------------------------------------------------------------------
+// Ripples from objects in the water, on top of the ocean of a CWaveGrid
+//--------------------------------------------------------------------------------------
+// A local wave solver after Tessendorf's iWave. A square area of the sea is split into cells, and each fixed step
+// the height of every cell is advanced by h' = (h (2 - a dt) - h_prev - g dt^2 (G * h)) / (1 + a dt), where a is
+// the damping and G a KERNEL_RADIUS-cell convolution kernel standing for the vertical derivative, so ripples spread
+// out at the speed of real water waves of their length, whatever the cell size. Displace pushes water aside where
+// an object sits or moves.
+// The cells are grouped into square tiles, and only the tiles holding ripples are stepped: a tile wakes when water
+// is displaced in it or a ripple comes within reach of the kernel, and goes back to sleep, zeroed, once its ripples
+// have died down, so calm water costs nothing. Each awake tile copies itself and the edges of its neighbours into
+// a padded buffer and is then stepped from there on its own, in parallel, convolving four cells at a time with SSE.
+// CWaveGrid::SetInteractiveWaves adds the heights to the grid's vertices as it emits them, or a WaveSimulationThread
+// as it uploads them.
+
+#ifndef _INTERACTIVE_WAVES_H_INCLUDED_
+#define _INTERACTIVE_WAVES_H_INCLUDED_
+
+#include "CVector2.h"
+#include "CVector3.h"
+#include "ThreadPool.h"
+#include "AlignedAllocator.h"
+#include <vector>
+
+class InteractiveWaves
+{
+public:
+
+	// Construction //
+
+	// Covers a square of side size world units centred on centre (x, z), in cells cellSize across, rounded up to
+	// whole tiles. timeStep is the fixed step in seconds. The tiles are stepped on threadPool, which is shared (e.g.
+	// CWaveGrid::Threads()); while another thread has a loop running on it, Update steps the tiles serially. All memory
+	// is allocated here
+	InteractiveWaves(ThreadPool& threadPool, CVector2 centre, float size, float cellSize = 0.125f, float timeStep = 1.0f / 60.0f);
+
+
+	// Usage //
+
+	// Pushes volume cubic units of water away from a disc of the given radius at (x, z), lowering the surface there
+	// smoothly towards the middle; a negative volume lets it back. Objects should displace what they have submerged
+	// at their new position and take back what they displaced at the old one, so only changes make ripples. Off the
+	// area the water is left alone. Takes effect on the next step
+	void Displace(float x, float z, float radius, float volume);
+
+	// Advances the ripples by frameTime in fixed steps, taking at most MAX_STEPS
+	void Update(float frameTime);
+
+	// Height of the ripples and their slope along x and z at world (x, z), zero off the area and over sleeping tiles
+	void Sample(float x, float z, float& height, float& slopeX, float& slopeZ) const;
+
+	// Lifts a vertex of a grid whose model is at origin by the ripples where it ends up, and tilts its normal by
+	// their slope
+	void Lift(const CVector3& origin, CVector3& position, CVector3& normal) const;
+
+	int GetAwakeTileCount() const { return mAwakeCount; }
+	int GetTileCount() const      { return static_cast<int>(mTiles.size()); }
+
+	// Seconds the last Update took
+	float LastUpdateTime() const { return mLastUpdateTime; }
+
+
+	static const int TILE_SIZE = 32;        // Cells along each side of a tile, a multiple of 4
+	static const int KERNEL_RADIUS = 6;     // The kernel covers (2 * KERNEL_RADIUS + 1)^2 cells
+	const float GRAVITY = 9.81f;
+	const float DAMPING = 0.4f;             // Per second
+	const float SLEEP_HEIGHT = 1e-4f;       // A tile sleeps once no cell moves or stands further from level than this
+
+
+private:
+	// Cells are stored row by row along z. A sleeping tile's cells are all zero
+	struct Tile
+	{
+		AlignedVector<float> height, previous;
+		AlignedVector<float> padded;    // height with KERNEL_RADIUS cells of the neighbours around it, for the step
+		bool  awake;
+		bool  wake;                     // To be woken for the next step
+		float reach[3][3];              // Largest movement near each edge and corner in the last step, by side
+	};
+
+	void Step();
+
+	// Copies a tile and the cells of its neighbours within reach of the kernel into its padded buffer
+	void Gather(int tileX, int tileZ);
+
+	// Steps one tile from its padded buffer and notes how far its ripples reach
+	void StepTile(Tile& tile);
+
+	float CellHeight(int cellX, int cellZ) const;
+
+	ThreadPool& mThreadPool;
+	CVector2   mOrigin;       // World position of the corner of cell (0, 0)
+	float      mCellSize;
+	float      mTimeStep;
+	float      mAccumulator;  // Time not yet stepped through
+	float      mLastUpdateTime;
+	int        mTilesX;       // Along each side
+	int        mCells;        // Along each side
+
+	std::vector<Tile> mTiles; // Row by row along z
+	std::vector<int>  mAwake; // Indices of the tiles stepped this step
+	int               mAwakeCount;
+
+	// The kernel weights for offsets 0..KERNEL_RADIUS along each axis; the kernel is symmetric in both
+	float mKernel[KERNEL_RADIUS + 1][KERNEL_RADIUS + 1];
+
+	static const int MAX_STEPS = 4;
+	static const int PADDED_SIZE = TILE_SIZE + 2 * KERNEL_RADIUS;
+};
+
+
+#endif //_INTERACTIVE_WAVES_H_INCLUDED_
@@ -0,0 +1,64 @@
+//--------------------------------------------------------------------------------------
+// Counter-based random numbers
+//--------------------------------------------------------------------------------------
+// Philox4x32-10 from Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3" (SC11).
+// Instead of stepping a hidden state, each call scrambles a counter with a key, so the
+// numbers for a given (key, counter) never depend on what was generated before. That makes
+// them safe to generate in any order, on any number of threads, and the same everywhere.
+
+#ifndef _COUNTER_RANDOM_H_DEFINED_
+#define _COUNTER_RANDOM_H_DEFINED_
+
+#include "MathHelpers.h"
+#include <cmath>
+#include <stdint.h>
+
+
+// Scrambles a 128-bit counter with a 64-bit key into 128 random bits
+inline void Philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4])
+{
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for (int round = 0; round < 10; round++)
+	{
+		const uint64_t product0 = static_cast<uint64_t>(0xD2511F53u) * c0;
+		const uint64_t product1 = static_cast<uint64_t>(0xCD9E8D57u) * c2;
+		c0 = static_cast<uint32_t>(product1 >> 32) ^ c1 ^ k0;
+		c2 = static_cast<uint32_t>(product0 >> 32) ^ c3 ^ k1;
+		c1 = static_cast<uint32_t>(product1);
+		c3 = static_cast<uint32_t>(product0);
+
+		// Weyl sequence on the key between rounds
+		k0 += 0x9E3779B9u;
+		k1 += 0xBB67AE85u;
+	}
+
+	result[0] = c0;
+	result[1] = c1;
+	result[2] = c2;
+	result[3] = c3;
+}
+
+// Maps 32 random bits to a float in (0, 1], never 0 so its log is always finite
+inline float UniformFromBits(const uint32_t bits)
+{
+	return static_cast<float>((bits >> 8) + 1) * (1.0f / 16777216.0f);
+}
+
+// Two independent standard normal numbers for the given seed and pair of indices (Box-Muller transform,
+// so unlike polar rejection sampling it always takes exactly one draw)
+inline void GaussianPair(const uint32_t seed, const int32_t a, const int32_t b, float& g0, float& g1)
+{
+	const uint32_t counter[4] = { static_cast<uint32_t>(a), static_cast<uint32_t>(b), 0u, 0u };
+	const uint32_t key[2] = { seed, 0x5EEDF00Du };
+	uint32_t bits[4];
+	Philox4x32(counter, key, bits);
+
+	const float radius = std::sqrt(-2.0f * std::log(UniformFromBits(bits[0])));
+	const float angle = 2.0f * PI * UniformFromBits(bits[1]);
+	g0 = radius * std::cos(angle);
+	g1 = radius * std::sin(angle);
+}
+
+#endif // _COUNTER_RANDOM_H_DEFINED_
@@ -534,76 +534,19 @@ void Mesh::RenderSubMesh(const SubMesh& subMesh)
 	gD3DContext->DrawIndexed(subMesh.numIndices, 0, 0);
 }
 
-struct waterGridVertexData {
-	CVector3 pos = { 0.0f, 0.0f, 0.0f };
-	CVector3 normal = { 0.0f, 0.0f, 0.0f };
-	CVector2 uv = { 0.0f, 1.0f };
-};
-
-void Mesh::UpdateNodeVertexBuffer(unsigned int node, unsigned int subdiv, std::vector<CVector3> VertexData, std::vector<CVector3> VertexNormalData)
+void* Mesh::MapVertexBuffer(unsigned int node)
 {
-	//auto vertexData = std::make_unique<char[]>(mSubMeshes[0].numVertices * mSubMeshes[0].vertexSize); // Smart pointer
-	int loopLength = subdiv + 1;
-	std::vector<waterGridVertexData> waterVertexData;
-
-	// Create the grid vertices (CPU-side), to be passed to the GPU afterwards
-	float uStep = 1.0f / subdiv;                // U-size of a single grid square (UVs go from 0 to 1 over the whole grid)
-	float vStep = 1.0f / subdiv;                // V-size of a single grid square (UVs go from 0 to 1 over the whole grid)
-	waterGridVertexData temp;
-	//CVector3 pt = { 0, 0, 0 };                         // Start position at bottom-left of grid (looking down on it)
-	//CVector3 normal = CVector3(0, 1, 0);           // All normals will be up (useful to make grid use same data as ordinary models so it can use the same shaders)
-	//CVector2 uv = CVector2(0, 1);                 // UVs also start at bottom-left (V axis is opposite direction to Z)
-	// A 2D array of data, only complexity is that some data is optional. So byte-offsets and pointer casting is needed
-	//auto currVert = vertexData.get();
-	for (int z = 0; z < loopLength; ++z)
+	D3D11_MAPPED_SUBRESOURCE dataMapped;
+	if (FAILED(gD3DContext->Map(mSubMeshes[mNodes[node].subMeshes[0]].vertexBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &dataMapped)))
 	{
-		for (int x = 0; x < loopLength; ++x)
-		{
-			temp.pos.x = VertexData.at(loopLength * z + x).x;
-			temp.pos.y = VertexData.at(loopLength * z + x).y;
-			temp.pos.z = VertexData.at(loopLength * z + x).z;
-
-			temp.normal.x = VertexNormalData.at(loopLength * z + x).x;
-			temp.normal.y = VertexNormalData.at(loopLength * z + x).y;
-			temp.normal.z = VertexNormalData.at(loopLength * z + x).z;
-
-			//*reinterpret_cast<CVector3*>(currVert) = pt;
-			//currVert += sizeof(CVector3);
-			 
-			//*reinterpret_cast<CVector3*>(currVert) = normal;
-			//currVert += sizeof(CVector3);
-			 
-			//*reinterpret_cast<CVector2*>(currVert) = uv;
-			//currVert += sizeof(CVector2);
-			
-			temp.uv.x += uStep;
-			waterVertexData.push_back(temp);
-		}
-		temp.uv.x = 0;
-		temp.uv.y -= vStep; // V axis is opposite direction to Z
+		return nullptr;
 	}
+	return dataMapped.pData;
+}
 
-	D3D11_MAPPED_SUBRESOURCE dataMapped;
-	gD3DContext->Map(mSubMeshes[0].vertexBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &dataMapped);
-	waterGridVertexData* vertexBufferData = (waterGridVertexData*)dataMapped.pData;
-	for (int i = 0; i < waterVertexData.size(); i++) {
-		*vertexBufferData++ = waterVertexData[i];
-	}
-	gD3DContext->Unmap(mSubMeshes[0].vertexBuffer, 0);
-
-	//// Create the vertex buffer and fill it with the loaded vertex data
-	//D3D11_BUFFER_DESC bufferDesc;
-	//bufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-	//bufferDesc.Usage = D3D11_USAGE_DEFAULT; // Not a dynamic buffer
-	//bufferDesc.ByteWidth = mSubMeshes[0].numVertices * mSubMeshes[0].vertexSize; // Buffer size
-	//bufferDesc.CPUAccessFlags = 0;
-	//bufferDesc.MiscFlags = 0;
-	//D3D11_SUBRESOURCE_DATA initData; // Initial data
-	//initData.pSysMem = vertexData.get();
-	//if (FAILED(gD3DDevice->CreateBuffer(&bufferDesc, &initData, &mSubMeshes[0].vertexBuffer)))
-	//{
-	//	throw std::runtime_error("Failure creating vertex buffer for grid mesh");
-	//}
+void Mesh::UnmapVertexBuffer(unsigned int node)
+{
+	gD3DContext->Unmap(mSubMeshes[mNodes[node].subMeshes[0]].vertexBuffer, 0);
 }
 
 // Render the mesh with the given matrices
@@ -38,7 +38,16 @@ public:
     // The default matrix for a given node - used to set the initial position for a new model
     CMatrix4x4 GetNodeDefaultMatrix(unsigned int node) { return mNodes[node].defaultMatrix; }
 
-	void UpdateNodeVertexBuffer(unsigned int node, unsigned int subdiv, std::vector<CVector3> VertexData, std::vector<CVector3> VertexNormalData);
+	// Direct write access to the vertex buffer of a node in a dynamic mesh (i.e. a grid mesh), for meshes that are
+	// regenerated every frame. The previous contents are discarded, so every vertex must be written before
+	// UnmapVertexBuffer, and the memory is write-combined so it should be written in order and never read.
+	// Returns nullptr on failure
+	void* MapVertexBuffer(unsigned int node);
+	void  UnmapVertexBuffer(unsigned int node);
+
+	// Layout of the vertex buffer of a node: size in bytes of a single vertex and the number of vertices
+	unsigned int VertexSize(unsigned int node)   { return mSubMeshes[mNodes[node].subMeshes[0]].vertexSize; }
+	unsigned int NumVertices(unsigned int node)  { return mSubMeshes[mNodes[node].subMeshes[0]].numVertices; }
 
 	// Render the mesh with the given matrices
 	// Handles rigid body meshes (including single part meshes) as well as skinned meshes
@@ -74,6 +74,9 @@ public:
 
     void SetWorldMatrix(CMatrix4x4 matrix, int node = 0)  { mWorldMatrices[node] = matrix; }
 
+    // Render a different mesh from now on, keeping the matrices. It must have the same node hierarchy, e.g. a grid of another size
+    void SetMesh(Mesh* mesh)  { mMesh = mesh; }
+
 
 	//-------------------------------------
 	// Private data / members
@@ -19,10 +19,16 @@
 #include "GraphicsHelpers.h" // Helper functions to unclutter the code here
 #include "ColourRGBA.h" 
 #include "CWaterGrid.h"
+#include "WaveSimulationThread.h"
+#include "Buoyancy.h"
+#include "InteractiveWaves.h"
+#include "WaveGridGovernor.h"
+#include "Timer.h"
 
 #include <array>
 #include <sstream>
 #include <memory>
+#include <algorithm>
 
 enum class PostProcess {
 	None,
@@ -52,10 +58,16 @@ Mesh* gWaveMesh;
 Model* gStars;
 Model* gGround;
 Model* gCargo;
+const int NUM_CRATES = 8;
+Model* gCrates[NUM_CRATES];
 Model* gVisualTestGrid;
 Camera* gCamera;
 Camera* gCubeMapCameras[6];
 CWaveGrid* gWaveGrid;
+WaveSimulationThread* gWaveSimThread; // Only while the water is simulated asynchronously
+BuoyancySystem* gBuoyancy; // Floats gCargo and gCrates on gWaveGrid
+InteractiveWaves* gRipples; // Spread from the floating bodies over gWaveGrid's tile
+WaveGridGovernor* gWaveGridGovernor; // Chooses gWaveGrid's resolution
 
 // Store lights in an array in this exercise
 const int NUM_LIGHTS = 2;
@@ -79,6 +91,10 @@ const float gLightOrbitRadius = 20.0f;
 const float gLightOrbitSpeed = 0.7f;
 
 //Variables relating to the water visuals
+const float WATER_SIMULATION_BUDGET = 0.004f; // Seconds per frame the wave simulation may take, its resolution is adjusted to fit
+const int   WATER_MIN_SIZE = 16;
+const int   WATER_MAX_SIZE = 256;
+const int   WATER_MAX_CASCADES = 1;     // The scene is tuned for one; more would bring in the long swell as the governor steps up
 static float waterRefractiveIndex = 1.33f;
 static const int sceneCubeMapSize = 2056;
 
@@ -600,14 +616,33 @@ bool InitScene()
 	gStars = new Model(gStarsMesh);
 	gGround = new Model(gGroundMesh);
 	gWaveGrid = new CWaveGrid(32, 0.0005f, { 16.0f, 16.0f }, 32);
+	gWaveGrid->ReserveResolution(WATER_MIN_SIZE, WATER_MAX_SIZE, WATER_MAX_CASCADES);
+	gWaveGridGovernor = new WaveGridGovernor(WATER_SIMULATION_BUDGET, WATER_MIN_SIZE, WATER_MAX_SIZE, WATER_MAX_CASCADES,
+	                                         gWaveGrid->Size(), gWaveGrid->NumCascades());
 	gVisualTestGrid = new Model(gWaveMesh);
 	gCargo = new Model(gCargoMesh);
 	// Initial positions
 	gStars->SetScale(8000.0f);
 	gWaveGrid->mWaterGridModel->SetPosition({ 0, 17.5f, 0 });
-	gCargo->SetScale(10.0f);
-	gCargo->SetPosition({ 0.0f, -100.0f, -120.0f });
+	gCargo->SetScale(0.5f);
+	gCargo->SetPosition({ 0.0f, 20.0f, 0.0f });
 	gGround->SetPosition({0.0f, 0.0f, -10.0f});
+
+	// Everything floating is dropped onto the water tile and left to settle. The cube mesh is 10 units across
+	gBuoyancy = new BuoyancySystem(gWaveGrid);
+	gBuoyancy->AddBody(gCargo, { 2.5f, 2.5f, 2.5f }, 500.0f);
+	for (int i = 0; i < NUM_CRATES; ++i)
+	{
+		gCrates[i] = new Model(gCargoMesh);
+		gCrates[i]->SetScale({ 0.3f, 0.2f, 0.4f });
+		gCrates[i]->SetRotation({ 0.0f, ToRadians(Random(0.0f, 360.0f)), 0.0f });
+		float angle = i * 2.0f * PI / NUM_CRATES;
+		gCrates[i]->SetPosition({ 10.0f * cos(angle), 20.0f, 10.0f * sin(angle) });
+		gBuoyancy->AddBody(gCrates[i], { 1.5f, 1.0f, 2.0f }, Random(300.0f, 700.0f));
+	}
+	gRipples = new InteractiveWaves(gWaveGrid->Threads(), { 0.0f, 0.0f }, gWaveGrid->Length());
+	gBuoyancy->SetInteractiveWaves(gRipples);
+	gWaveGrid->SetInteractiveWaves(gRipples);
 	// Light set-up - using an array this time
 	for (int i = 0; i < NUM_LIGHTS; ++i)
 	{
@@ -705,8 +740,16 @@ void ReleaseResources()
 	delete gCamera;  gCamera = nullptr;
 	delete gGround;  gGround = nullptr;
 	delete gStars;   gStars = nullptr;
+	delete gWaveSimThread; gWaveSimThread = nullptr; // Before anything it may still read while it emits a frame
+	delete gBuoyancy; gBuoyancy = nullptr;
+	delete gRipples; gRipples = nullptr;
+	for (int i = 0; i < NUM_CRATES; ++i)
+	{
+		delete gCrates[i];  gCrates[i] = nullptr;
+	}
 	delete gCargo; gCargo = nullptr;
 
+	delete gWaveGridGovernor; gWaveGridGovernor = nullptr;
 	delete gWaveGrid; gWaveGrid = nullptr;
 	delete gVisualTestGrid; gVisualTestGrid = nullptr;
 	delete gLightMesh;   gLightMesh = nullptr;
@@ -816,6 +859,9 @@ void RenderSceneFromCamera(Camera* camera, bool bRenderReflectantObjects)
 	gD3DContext->PSSetShaderResources(0, 1, &gGroundDiffuseSpecularMapSRV); // First parameter must match texture slot number in the shader
 	gGround->Render();
 
+	gD3DContext->PSSetShaderResources(0, 1, &gCrateDiffuseSpecularMapSRV);
+	for (int i = 0; i < NUM_CRATES; ++i)  gCrates[i]->Render();
+
 	if (bRenderReflectantObjects) {
 		gD3DContext->PSSetShader(gWaterCombinedPixelShader, nullptr, 0);
 		//gD3DContext->PSSetShaderResources(0, 1, &gGroundDiffuseSpecularMapSRV);
@@ -1039,10 +1085,109 @@ void UpdateScene(float frameTime)
 	static bool waterSimOn = false;
 
 	if (KeyHit(Key_G)) waterSimOn = !waterSimOn;
+
+	// Toggle simulating the water on its own thread, one frame ahead
+	if (KeyHit(Key_H))
+	{
+		if (gWaveSimThread) { delete gWaveSimThread; gWaveSimThread = nullptr; }
+		else                gWaveSimThread = new WaveSimulationThread(gWaveGrid);
+	}
+
+	// Weather: J/K turn the wind, U/I make it weaker or stronger. Not while the grid belongs to the simulation thread
+	if (!gWaveSimThread && (KeyHeld(Key_J) || KeyHeld(Key_K) || KeyHeld(Key_U) || KeyHeld(Key_I)))
+	{
+		const float windTurnSpeed = 0.5f;   // Radians per second
+		const float windChangeSpeed = 0.5f; // Fraction of the wind speed per second
+		CVector2 wind = gWaveGrid->Wind();
+		float angle = atan2(wind.y, wind.x);
+		float speed = sqrt(wind.x * wind.x + wind.y * wind.y);
+		if (KeyHeld(Key_J))  angle += windTurnSpeed * frameTime;
+		if (KeyHeld(Key_K))  angle -= windTurnSpeed * frameTime;
+		if (KeyHeld(Key_U))  speed = std::max(speed * (1.0f - windChangeSpeed * frameTime), 1.0f);
+		if (KeyHeld(Key_I))  speed = std::min(speed * (1.0f + windChangeSpeed * frameTime), 50.0f);
+		gWaveGrid->SetWind({ speed * cos(angle), speed * sin(angle) });
+	}
+
+	// Toggle adjusting the water resolution to the machine
+	static bool governorOn = true;
+	if (KeyHit(Key_O))  governorOn = !governorOn;
+
+	// Toggle the cheaper Gerstner sum in place of the FFT, and halve or double the number of waves it keeps with
+	// comma and period. Not while the simulation thread owns the grid, which always uses the FFT
+	static bool gerstnerOn = false;
+	if (KeyHit(Key_B) && !gWaveSimThread)  gerstnerOn = !gerstnerOn;
+	if (KeyHit(Key_Comma) && !gWaveSimThread)   gWaveGrid->SetGerstnerWaveCount(std::max(gWaveGrid->GerstnerWaveCount() / 2, 4));
+	if (KeyHit(Key_Period) && !gWaveSimThread)  gWaveGrid->SetGerstnerWaveCount(std::min(gWaveGrid->GerstnerWaveCount() * 2, 4096));
+
+	// Halve the threads the water is simulated on with R, going back to all of them after one, to see how it scales
+	if (KeyHit(Key_R) && !gWaveSimThread)
+	{
+		ThreadPool& threads = gWaveGrid->Threads();
+		threads.SetThreadCount(threads.GetThreadCount() > 1 ? threads.GetThreadCount() / 2 : threads.GetMaxThreadCount());
+	}
+
+	// Toggle solving the FFT only 30 times a second and blending the frames in between, which takes over from the
+	// Gerstner sum while on. Likewise not on the simulation thread
+	static bool amortisedOn = false;
+	if (KeyHit(Key_T))  amortisedOn = !amortisedOn;
+
+	// Toggle transforming the coarser cascades, which only hold long slow waves, 15 times a second rather than every
+	// frame. Applies to the FFT wherever it runs, so not while the simulation thread owns the grid
+	if (KeyHit(Key_Y) && !gWaveSimThread)
+	{
+		gWaveGrid->SetBandRefreshRate(gWaveGrid->BandRefreshRate() > 0 ? 0.0f : 15.0f);
+	}
+
+	// Toggle a sea bed shelving from half a metre deep along one edge of the tile to deep water along the other, so
+	// the waves slow down towards the shallow side. Not while the simulation thread owns the grid
+	static bool shelfOn = false;
+	if (KeyHit(Key_V) && !gWaveSimThread)
+	{
+		shelfOn = !shelfOn;
+		const int resolution = 16;
+		std::vector<float> depths;
+		for (int row = 0; shelfOn && row < resolution; ++row)
+		{
+			for (int column = 0; column < resolution; ++column)  depths.push_back(0.5f * pow(128.0f, column / (resolution - 1.0f)));
+		}
+		gWaveGrid->SetBathymetry(depths, resolution);
+	}
+
+	static float totalStepTime = 0;
 	if (waterSimOn) {
 		timeScale += frameTime;
-		gWaveGrid->WavesEvaluation(timeScale);
+		float stepTime;
+		if (gWaveSimThread)
+		{
+			gWaveSimThread->Update(timeScale + frameTime); // Assume the next frame takes as long as this one
+			stepTime = gWaveSimThread->GetStats().lastStepTime;
+		}
+		else
+		{
+			Timer stepTimer;
+			stepTimer.Start();
+			if (amortisedOn)      gWaveGrid->WavesEvaluationAmortised(timeScale);
+			else if (gerstnerOn)  gWaveGrid->WavesEvaluationGerstner(timeScale);
+			else                  gWaveGrid->WavesEvaluationFFT(timeScale);
+			stepTime = stepTimer.GetTime();
+		}
+		totalStepTime += stepTime;
+
+		// The simulation thread uploads to the mesh the grid had when it was made, so it is remade with the grid
+		if (governorOn && gWaveGridGovernor->Update(stepTime))
+		{
+			bool async = gWaveSimThread != nullptr;
+			delete gWaveSimThread; gWaveSimThread = nullptr;
+			gWaveGrid->SetResolution(gWaveGridGovernor->Size(), gWaveGridGovernor->NumCascades());
+			if (async)  gWaveSimThread = new WaveSimulationThread(gWaveGrid);
+		}
 	}
+
+	// While the grid is simulated in the background, queries read the step on screen and the ripples are added as
+	// each step is uploaded, so both run every frame either way
+	gBuoyancy->Update(frameTime);
+	gRipples->Update(frameTime);
+
 	// Show frame time / FPS in the window title //
 	const float fpsUpdateTime = 0.5f; // How long between updates (in seconds)
 	static float totalFrameTime = 0;
@@ -1053,13 +1198,61 @@ void UpdateScene(float frameTime)
 	{
 		// Displays FPS rounded to nearest int, and frame time (more useful for developers) in milliseconds to 2 decimal places
 		float avgFrameTime = totalFrameTime / frameCount;
+
+		// While the simulation thread owns the grid, its settings are taken from the thread instead
+		const WaveSimulationThread::Stats* simStats = gWaveSimThread ? &gWaveSimThread->GetStats() : nullptr;
+		const int          waterSize       = simStats ? simStats->size : gWaveGrid->Size();
+		const int          waterCascades   = simStats ? simStats->numCascades : gWaveGrid->NumCascades();
+		const unsigned int waterThreads    = simStats ? simStats->threadCount : gWaveGrid->Threads().GetThreadCount();
+		const float        bandRefreshRate = simStats ? simStats->bandRefreshRate : gWaveGrid->BandRefreshRate();
+		const bool         hasBathymetry   = simStats ? simStats->hasBathymetry : gWaveGrid->HasBathymetry();
+
 		std::ostringstream frameTimeMs;
 		frameTimeMs.precision(2);
 		frameTimeMs << std::fixed << avgFrameTime * 1000;
 		std::string windowTitle = "Third Year Project - Water Simulation - Frame Time: " + frameTimeMs.str() +
-			"ms, FPS: " + std::to_string(static_cast<int>(1 / avgFrameTime + 0.5f));
+			"ms, FPS: " + std::to_string(static_cast<int>(1 / avgFrameTime + 0.5f)) +
+			" - Water " + std::to_string(waterSize) + "x" + std::to_string(waterSize) + ", " +
+			std::to_string(waterCascades) + (waterCascades == 1 ? " cascade" : " cascades");
+		if (waterSimOn)
+		{
+			std::ostringstream stepTimeMs;
+			stepTimeMs.precision(2);
+			stepTimeMs << std::fixed << totalStepTime / frameCount * 1000;
+			windowTitle += ", step " + stepTimeMs.str() + "ms on " + std::to_string(waterThreads) + " threads";
+		}
+		if (bandRefreshRate > 0 && waterCascades > 1)
+		{
+			windowTitle += ", long waves at " + std::to_string(static_cast<int>(bandRefreshRate + 0.5f)) + "Hz";
+		}
+		if (gRipples->GetAwakeTileCount() > 0)
+		{
+			windowTitle += ", ripples on " + std::to_string(gRipples->GetAwakeTileCount()) + "/" +
+				std::to_string(gRipples->GetTileCount()) + " tiles";
+		}
+		if (hasBathymetry)
+		{
+			windowTitle += ", shelving sea bed";
+		}
+		if (amortisedOn && !gWaveSimThread)
+		{
+			windowTitle += ", FFT at " + std::to_string(static_cast<int>(gWaveGrid->AmortisedRate() + 0.5f)) + "Hz";
+		}
+		else if (gerstnerOn && !gWaveSimThread)
+		{
+			windowTitle += ", Gerstner " + std::to_string(gWaveGrid->GerstnerWaveCount()) + " waves";
+		}
+		if (simStats)
+		{
+			std::ostringstream latencyMs;
+			latencyMs.precision(2);
+			latencyMs << std::fixed << simStats->averageLatency * 1000;
+			windowTitle += " - Async water: latency " + latencyMs.str() + "ms, missed " + std::to_string(simStats->missedDeadlines) +
+				", dropped " + std::to_string(simStats->framesDropped);
+		}
 		SetWindowTextA(gHWnd, windowTitle.c_str());
 		totalFrameTime = 0;
+		totalStepTime = 0;
 		frameCount = 0;
 	}
 }
@@ -0,0 +1,65 @@
+//--------------------------------------------------------------------------------------
+// Allocator for std::vector whose storage starts on a given boundary (a cache line by
+// default), so arrays streamed by SIMD loops never split a vector load across two lines
+//--------------------------------------------------------------------------------------
+
+#ifndef _ALIGNED_ALLOCATOR_H_INCLUDED_
+#define _ALIGNED_ALLOCATOR_H_INCLUDED_
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+template <class T, size_t Alignment = 64>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+
+	template <class U>
+	struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() {}
+	template <class U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(size_t count)
+	{
+		if (count == 0) return nullptr;
+		if (count > static_cast<size_t>(-1) / sizeof(T)) throw std::bad_alloc();
+
+#ifdef _MSC_VER
+		void* memory = _aligned_malloc(count * sizeof(T), Alignment);
+#else
+		void* memory = nullptr;
+		if (posix_memalign(&memory, Alignment, count * sizeof(T)) != 0) memory = nullptr;
+#endif
+		if (!memory) throw std::bad_alloc();
+		return static_cast<T*>(memory);
+	}
+
+	void deallocate(T* memory, size_t)
+	{
+#ifdef _MSC_VER
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+};
+
+template <class T, class U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return true; }
+
+template <class T, class U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return false; }
+
+// std::vector with cache-line aligned storage
+template <class T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+#endif //_ALIGNED_ALLOCATOR_H_INCLUDED_
@@ -0,0 +1,81 @@
+//--------------------------------------------------------------------------------------
+// MappedFile class - a whole file mapped read-only into memory
+//--------------------------------------------------------------------------------------
+
+#include "MappedFile.h"
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& fileName) : mData(nullptr), mSize(0), mFile(INVALID_HANDLE_VALUE), mMapping(nullptr)
+{
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+	                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)  throw std::runtime_error("Cannot open " + fileName);
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || static_cast<unsigned long long>(size.QuadPart) > SIZE_MAX)
+	{
+		CloseHandle(file);
+		throw std::runtime_error("Cannot map " + fileName + ": empty or too large");
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (view == nullptr)
+	{
+		if (mapping)  CloseHandle(mapping);
+		CloseHandle(file);
+		throw std::runtime_error("Cannot map " + fileName);
+	}
+
+	mFile = file;
+	mMapping = mapping;
+	mData = static_cast<const unsigned char*>(view);
+	mSize = static_cast<size_t>(size.QuadPart);
+}
+
+MappedFile::~MappedFile()
+{
+	UnmapViewOfFile(mData);
+	CloseHandle(mMapping);
+	CloseHandle(mFile);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& fileName) : mData(nullptr), mSize(0)
+{
+	int file = open(fileName.c_str(), O_RDONLY);
+	if (file < 0)  throw std::runtime_error("Cannot open " + fileName);
+
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0)
+	{
+		close(file);
+		throw std::runtime_error("Cannot map " + fileName + ": empty or unreadable");
+	}
+
+	void* view = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+	close(file); // the mapping keeps the file open
+	if (view == MAP_FAILED)  throw std::runtime_error("Cannot map " + fileName);
+
+	mData = static_cast<const unsigned char*>(view);
+	mSize = static_cast<size_t>(status.st_size);
+}
+
+MappedFile::~MappedFile()
+{
+	munmap(const_cast<unsigned char*>(mData), mSize);
+}
+
+#endif
@@ -0,0 +1,46 @@
+//--------------------------------------------------------------------------------------
+// MappedFile class - a whole file mapped read-only into memory
+//--------------------------------------------------------------------------------------
+// Code in .cpp file. Pages are only read from disk when first touched, and the OS can drop
+// them again under memory pressure, so large files cost little until they are used
+
+#ifndef _MAPPED_FILE_H_INCLUDED_
+#define _MAPPED_FILE_H_INCLUDED_
+
+#include <string>
+#include <cstddef>
+
+class MappedFile
+{
+public:
+
+	// Construction //
+
+	// Maps the whole file. Throws a std::runtime_error if it cannot be opened or mapped, or is empty
+	MappedFile(const std::string& fileName);
+
+	// Unmaps the file, invalidating every pointer into it
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+
+	// Data access //
+
+	const unsigned char* Data() const { return mData; }
+	size_t Size() const { return mSize; }
+
+
+private:
+	const unsigned char* mData;
+	size_t mSize;
+
+#ifdef _WIN32
+	void* mFile;
+	void* mMapping;
+#endif
+};
+
+
+#endif //_MAPPED_FILE_H_INCLUDED_
@@ -0,0 +1,96 @@
+//--------------------------------------------------------------------------------------
+// ThreadPool class - a fixed set of worker threads that split loops between them
+//--------------------------------------------------------------------------------------
+
+#include "ThreadPool.h"
+#include <algorithm>
+
+// Construction //
+
+ThreadPool::ThreadPool(unsigned int numThreads) :
+	mFunction(nullptr), mTask(nullptr), mCount(0), mNumChunks(0), mPending(0), mGeneration(0), mQuit(false), mBusy(false)
+{
+	if (numThreads == 0) numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	mThreadCount = numThreads;
+
+	// Worker i always runs range i + 1 of a loop, range 0 being the caller's
+	mWorkers.reserve(numThreads - 1);
+	for (unsigned int i = 1; i < numThreads; i++)
+	{
+		mWorkers.emplace_back(&ThreadPool::WorkerLoop, this, static_cast<int>(i));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mWorkReady.notify_all();
+	for (auto& worker : mWorkers) worker.join();
+}
+
+
+// Parallel loops //
+
+void ThreadPool::SetThreadCount(unsigned int numThreads)
+{
+	mThreadCount = std::min(std::max(numThreads, 1u), GetMaxThreadCount());
+}
+
+
+void ThreadPool::Run(int count, TaskFunction function, void* task)
+{
+	if (count <= 0) return;
+
+	const int numChunks = std::min(count, static_cast<int>(GetThreadCount()));
+	if (numChunks == 1 || mBusy.exchange(true))
+	{
+		function(task, 0, count);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mFunction = function;
+		mTask = task;
+		mCount = count;
+		mNumChunks = numChunks;
+		mPending = numChunks - 1;
+		mGeneration++;
+	}
+	mWorkReady.notify_all();
+
+	function(task, 0, ChunkStart(count, numChunks, 1));
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mWorkDone.wait(lock, [this] { return mPending == 0; });
+	mBusy = false;
+}
+
+void ThreadPool::WorkerLoop(int chunk)
+{
+	unsigned int seenGeneration = 0;
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (true)
+	{
+		mWorkReady.wait(lock, [&] { return mQuit || mGeneration != seenGeneration; });
+		if (mQuit) return;
+		seenGeneration = mGeneration;
+
+		// Loops shorter than the pool leave the last workers idle
+		if (chunk >= mNumChunks) continue;
+
+		const TaskFunction function = mFunction;
+		void* task = mTask;
+		const int begin = ChunkStart(mCount, mNumChunks, chunk);
+		const int end = ChunkStart(mCount, mNumChunks, chunk + 1);
+
+		lock.unlock();
+		function(task, begin, end);
+		lock.lock();
+
+		if (--mPending == 0) mWorkDone.notify_one();
+	}
+}
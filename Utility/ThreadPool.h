@@ -0,0 +1,90 @@
+//--------------------------------------------------------------------------------------
+// ThreadPool class - a fixed set of worker threads that split loops between them
+//--------------------------------------------------------------------------------------
+// Code in .cpp file
+
+#ifndef _THREADPOOL_H_INCLUDED_
+#define _THREADPOOL_H_INCLUDED_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+class ThreadPool
+{
+public:
+
+	// Construction //
+
+	// Starts numThreads - 1 workers, the calling thread being the last one. Zero uses every hardware thread
+	ThreadPool(unsigned int numThreads = 0);
+
+	// Stops and joins the workers
+	~ThreadPool();
+
+
+	// Parallel loops //
+
+	// Number of threads taking part in a loop, including the calling thread
+	unsigned int GetThreadCount() const { return mThreadCount; }
+
+	// Number of threads the pool was made with, the most GetThreadCount can be
+	unsigned int GetMaxThreadCount() const { return static_cast<unsigned int>(mWorkers.size()) + 1; }
+
+	// Has later loops use only numThreads threads, clamped to 1..GetMaxThreadCount(), the other workers staying
+	// asleep; for measuring how the work scales. Must not be called while a loop is running
+	void SetThreadCount(unsigned int numThreads);
+
+	// Calls task(begin, end) on contiguous ranges covering [0, count) and returns when all of them are done.
+	// The ranges depend only on count and the thread count, never on timing, so as long as every index is
+	// written by exactly one range the results are the same as a serial loop. The calling thread takes the
+	// first range. A loop started while another is running, from a second thread or inside a task, is run
+	// serially on the calling thread instead.
+	template <class Task>
+	void ParallelFor(int count, Task& task)
+	{
+		Run(count, &InvokeTask<Task>, &task);
+	}
+
+
+private:
+	typedef void (*TaskFunction)(void* task, int begin, int end);
+
+	template <class Task>
+	static void InvokeTask(void* task, int begin, int end)
+	{
+		(*static_cast<Task*>(task))(begin, end);
+	}
+
+	// Start of range number chunk when count is split into numChunks
+	static int ChunkStart(int count, int numChunks, int chunk)
+	{
+		return static_cast<int>(static_cast<long long>(count) * chunk / numChunks);
+	}
+
+	void Run(int count, TaskFunction function, void* task);
+	void WorkerLoop(int chunk);
+
+	std::vector<std::thread> mWorkers;
+
+	std::mutex              mMutex;
+	std::condition_variable mWorkReady;
+	std::condition_variable mWorkDone;
+
+	// Current loop, published under mMutex. mGeneration is bumped for every loop so workers can tell a new one from a spurious wake
+	TaskFunction mFunction;
+	void*        mTask;
+	int          mCount;
+	int          mNumChunks;
+	int          mPending;
+	unsigned int mGeneration;
+	bool         mQuit;
+
+	unsigned int mThreadCount; // Taking part in each loop
+	std::atomic<bool> mBusy;   // A loop has the workers
+};
+
+
+#endif //_THREADPOOL_H_INCLUDED_
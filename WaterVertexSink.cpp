@@ -0,0 +1,24 @@
+//--------------------------------------------------------------------------------------
+// Destinations for the vertices a CWaveGrid produces every frame
+//--------------------------------------------------------------------------------------
+
+#include "WaterVertexSink.h"
+#include "Mesh.h"
+#include <stdexcept>
+
+WaterGridVertex* MeshVertexSink::Begin(unsigned int numVertices)
+{
+	if (mMesh->VertexSize(mNode) != sizeof(WaterGridVertex) || mMesh->NumVertices(mNode) != numVertices)
+	{
+		throw std::runtime_error("Water grid mesh does not match the wave grid vertex layout");
+	}
+
+	void* vertices = mMesh->MapVertexBuffer(mNode);
+	if (vertices == nullptr)  throw std::runtime_error("Failure mapping water grid vertex buffer");
+	return static_cast<WaterGridVertex*>(vertices);
+}
+
+void MeshVertexSink::End()
+{
+	mMesh->UnmapVertexBuffer(mNode);
+}
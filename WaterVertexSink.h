@@ -0,0 +1,72 @@
+//--------------------------------------------------------------------------------------
+// Destinations for the vertices a CWaveGrid produces every frame
+//--------------------------------------------------------------------------------------
+// The wave grid writes its final interleaved vertices straight into the memory a sink
+// hands out, so the only copy is the one into that memory: a mapped GPU buffer when
+// rendering, a plain array when running headless (tests, benchmarks, baking)
+
+#include "CVector2.h"
+#include "CVector3.h"
+#include "AlignedAllocator.h"
+
+#ifndef _WATER_VERTEX_SINK_H_INCLUDED_
+#define _WATER_VERTEX_SINK_H_INCLUDED_
+
+class Mesh;
+
+// One vertex of the water grid, laid out as in a grid Mesh created with normals and uvs
+struct WaterGridVertex
+{
+	CVector3 position;
+	CVector3 normal;
+	CVector2 uv;
+};
+
+
+class WaterVertexSink
+{
+public:
+	virtual ~WaterVertexSink() {}
+
+	// Memory for numVertices vertices, valid until End. Every vertex must be written, in any order, and none read back
+	virtual WaterGridVertex* Begin(unsigned int numVertices) = 0;
+	virtual void End() = 0;
+};
+
+
+// Writes into the vertex buffer of a grid mesh while it is mapped. Must be used on the thread that owns the D3D context
+class MeshVertexSink : public WaterVertexSink
+{
+public:
+	MeshVertexSink(Mesh* mesh, unsigned int node = 0) : mMesh(mesh), mNode(node) {}
+
+	// Throws a std::runtime_error if the mesh layout does not match WaterGridVertex or the buffer cannot be mapped
+	WaterGridVertex* Begin(unsigned int numVertices) override;
+	void End() override;
+
+private:
+	Mesh*        mMesh;
+	unsigned int mNode;
+};
+
+
+// Keeps the vertices in CPU memory, for running the simulation without a renderer
+class CpuVertexSink : public WaterVertexSink
+{
+public:
+	WaterGridVertex* Begin(unsigned int numVertices) override
+	{
+		mVertices.resize(numVertices);
+		return mVertices.data();
+	}
+	void End() override {}
+
+	// The vertices written by the last frame
+	const AlignedVector<WaterGridVertex>& Vertices() const { return mVertices; }
+
+private:
+	AlignedVector<WaterGridVertex> mVertices;
+};
+
+
+#endif //_WATER_VERTEX_SINK_H_INCLUDED_
@@ -0,0 +1,106 @@
+//--------------------------------------------------------------------------------------
+// Picks the wave grid resolution a machine can sustain within a frame-time budget
+//--------------------------------------------------------------------------------------
+
+#include "WaveGridGovernor.h"
+#include "CWaterGrid.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+WaveGridGovernor::WaveGridGovernor(float budget, int minSize, int maxSize, int maxCascades, int startSize, int startCascades)
+	: mLevel(0), mBudget(budget), mWindow(0), mSettleFrames(SETTLE_FRAMES), mSamples(0), mTotal(0), mAverage(0)
+{
+	if (minSize < CWaveGrid::MIN_SIZE || (minSize & (minSize - 1)) != 0 || maxSize < minSize || (maxSize & (maxSize - 1)) != 0 || maxCascades < 1)
+	{
+		throw std::runtime_error("Wave grid governor needs power-of-two sizes from " + std::to_string(CWaveGrid::MIN_SIZE) +
+		                         " up, small to large, and at least one cascade");
+	}
+
+	for (int size = minSize; size <= maxSize; size *= 2)
+	{
+		for (int numCascades = 1; numCascades <= maxCascades; ++numCascades)
+		{
+			mLevels.push_back({ size, numCascades, EstimateCost(size, numCascades), 0, FIRST_BACKOFF });
+		}
+	}
+	// Ties go to the larger size, whose detail shows more than another cascade of long waves
+	std::sort(mLevels.begin(), mLevels.end(), [](const Level& a, const Level& b)
+	{
+		return a.cost < b.cost || (a.cost == b.cost && a.size < b.size);
+	});
+
+	const float startCost = EstimateCost(startSize, startCascades);
+	for (int level = 0; level < static_cast<int>(mLevels.size()); ++level)
+	{
+		if (mLevels[level].size == startSize && mLevels[level].numCascades == startCascades)
+		{
+			mLevel = level;
+			break;
+		}
+		if (mLevels[level].cost <= startCost)  mLevel = level;
+	}
+}
+
+
+float WaveGridGovernor::EstimateCost(int size, int numCascades)
+{
+	const float points = static_cast<float>(size) * size;
+	return points * (numCascades * std::log2(static_cast<float>(size)) + 4.0f);
+}
+
+
+bool WaveGridGovernor::Update(float stepTime)
+{
+	if (mSettleFrames > 0)
+	{
+		--mSettleFrames;
+		return false;
+	}
+
+	mTotal += stepTime;
+	if (++mSamples < WINDOW_FRAMES)  return false;
+
+	mAverage = mTotal / mSamples;
+	mTotal = 0;
+	mSamples = 0;
+	++mWindow;
+
+	// Over budget: go down at once, far enough that the estimate fits, and keep away from this level for a while
+	if (mAverage > mBudget && mLevel > 0)
+	{
+		Level& failed = mLevels[mLevel];
+		failed.retryWindow = mWindow + failed.backoff;
+		failed.backoff = std::min(failed.backoff * 2, MAX_BACKOFF);
+
+		const float costPerSecond = mAverage / mLevels[mLevel].cost;
+		int level = mLevel - 1;
+		while (level > 0 && mLevels[level].cost * costPerSecond > mBudget)  --level;
+		ChangeLevel(level);
+		return true;
+	}
+
+	// Well inside the budget: try the next level up if it is estimated to fit with room to spare
+	if (mLevel + 1 < static_cast<int>(mLevels.size()))
+	{
+		const Level& next = mLevels[mLevel + 1];
+		const float estimate = mAverage * next.cost / mLevels[mLevel].cost;
+		if (estimate <= mBudget * STEP_UP_MARGIN && mWindow >= next.retryWindow)
+		{
+			ChangeLevel(mLevel + 1);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+void WaveGridGovernor::ChangeLevel(int level)
+{
+	mLevel = level;
+	mSettleFrames = SETTLE_FRAMES;
+	mTotal = 0;
+	mSamples = 0;
+}
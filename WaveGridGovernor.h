@@ -0,0 +1,77 @@
+//--------------------------------------------------------------------------------------
+// Picks the wave grid resolution a machine can sustain within a frame-time budget
+//--------------------------------------------------------------------------------------
+// The possible levels - every power-of-two size from minSize to maxSize with one to maxCascades cascades - are
+// ranked by their estimated cost. The governor averages the measured simulation time over a window of frames and
+// moves down a level as soon as the average is over budget, or up one when the next level's estimated time is
+// comfortably inside it. Hysteresis comes from that margin and from backing off: a level that had to be left is not
+// tried again for a number of windows that doubles every time, so a machine on the edge settles instead of flipping
+// between two levels.
+
+#ifndef _WAVE_GRID_GOVERNOR_H_INCLUDED_
+#define _WAVE_GRID_GOVERNOR_H_INCLUDED_
+
+#include <vector>
+
+class WaveGridGovernor
+{
+public:
+
+	// Construction //
+
+	// budget is the simulation time per frame in seconds. Starts at the level with startSize and startCascades, or the
+	// most expensive one cheaper than that. Throws a std::runtime_error if the sizes are not powers of two in order, or
+	// minSize is below CWaveGrid::MIN_SIZE
+	WaveGridGovernor(float budget, int minSize, int maxSize, int maxCascades, int startSize, int startCascades);
+
+
+	// Usage //
+
+	// Call once per frame with the time the simulation took for it. Returns true when the level has changed, after
+	// which the grid should be set to Size() and NumCascades(). Frames from just after a change are not counted
+	bool Update(float stepTime);
+
+	int Size() const        { return mLevels[mLevel].size; }
+	int NumCascades() const { return mLevels[mLevel].numCascades; }
+
+	// Mean simulation time over the last complete window, zero before the first
+	float AverageStepTime() const { return mAverage; }
+
+	void  SetBudget(float budget) { mBudget = budget; }
+	float Budget() const          { return mBudget; }
+
+
+private:
+	struct Level
+	{
+		int   size;
+		int   numCascades;
+		float cost;         // Estimated, relative to the other levels
+		int   retryWindow;  // First window in which stepping up to this level is allowed again
+		int   backoff;      // Windows to wait the next time this level has to be left
+	};
+
+	// Roughly what a frame costs: the batched transforms grow with N^2 log N for each cascade, the rest with N^2
+	static float EstimateCost(int size, int numCascades);
+
+	void ChangeLevel(int level);
+
+	std::vector<Level> mLevels; // Cheapest first
+	int   mLevel;
+	float mBudget;
+
+	int   mWindow;         // Number of windows completed
+	int   mSettleFrames;   // Frames still to skip after a change
+	int   mSamples;
+	float mTotal;
+	float mAverage;
+
+	static const int SETTLE_FRAMES = 10;   // Skipped after a change, while caches warm up
+	static const int WINDOW_FRAMES = 30;   // Averaged per decision
+	static const int FIRST_BACKOFF = 4;    // Windows
+	static const int MAX_BACKOFF   = 128;
+	const float STEP_UP_MARGIN = 0.75f; // The next level must be estimated at this fraction of the budget or less
+};
+
+
+#endif //_WAVE_GRID_GOVERNOR_H_INCLUDED_
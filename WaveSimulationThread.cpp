@@ -0,0 +1,164 @@
+//--------------------------------------------------------------------------------------
+// Runs a CWaveGrid on its own thread, one frame ahead of rendering
+//--------------------------------------------------------------------------------------
+
+#include "WaveSimulationThread.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+WaveSimulationThread::WaveSimulationThread(CWaveGrid* grid, int numBuffers)
+	: mGrid(grid), mMeshSink(grid->mWaterGridMesh), mRipples(grid->GetInteractiveWaves()),
+	  mHasRequest(false), mRequestTime(0), mReady(-1), mShown(0), mDropped(0), mStepTime(0), mQuit(false),
+	  mWaitingForFirst(true)
+{
+	if (numBuffers < 2 || numBuffers > 3)  throw std::runtime_error("Wave simulation thread needs 2 or 3 buffers");
+	mFrames.resize(numBuffers);
+
+	// Every buffer starts with the grid's texels, so copying a step's in never allocates, and the first stands for
+	// the step on screen until a new one is ready
+	for (Frame& frame : mFrames)  frame.queryTexels = grid->QueryTexels();
+	grid->SetQueryTexels(&mFrames[mShown].queryTexels);
+	grid->SetInteractiveWaves(nullptr);
+
+	mStats.size = grid->Size();
+	mStats.numCascades = grid->NumCascades();
+	mStats.threadCount = grid->Threads().GetThreadCount();
+	mStats.bandRefreshRate = grid->BandRefreshRate();
+	mStats.hasBathymetry = grid->HasBathymetry();
+
+	mThread = std::thread(&WaveSimulationThread::SimulationLoop, this);
+}
+
+WaveSimulationThread::~WaveSimulationThread()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mWake.notify_all();
+	mThread.join();
+
+	mGrid->SetVertexSink(nullptr);
+	mGrid->SetQueryTexels(nullptr);
+	mGrid->SetInteractiveWaves(mRipples);
+}
+
+
+bool WaveSimulationThread::Update(float nextTime)
+{
+	int frame;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mError)  std::rethrow_exception(mError);
+		frame = mReady;
+		if (frame >= 0)
+		{
+			mReady = -1;
+			mShown = frame;
+		}
+		mStats.framesDropped = mDropped;
+		mStats.lastStepTime = mStepTime;
+	}
+
+	if (frame >= 0)
+	{
+		// The simulation thread does not write into the buffer on screen, so it is ours until the next one is shown
+		mGrid->SetQueryTexels(&mFrames[frame].queryTexels);
+		const AlignedVector<WaterGridVertex>& vertices = mFrames[frame].vertices.Vertices();
+		WaterGridVertex* destination = mMeshSink.Begin(static_cast<unsigned int>(vertices.size()));
+		if (mRipples && mRipples->GetAwakeTileCount() > 0)
+		{
+			// As the grid would have emitted them. The loop runs serially if the simulation thread has the pool
+			const WaterGridVertex* source = vertices.data();
+			const CVector3 origin = mGrid->mWaterGridModel->Position();
+			auto liftVertices = [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+				{
+					WaterGridVertex vertex = source[i];
+					mRipples->Lift(origin, vertex.position, vertex.normal);
+					destination[i] = vertex;
+				}
+			};
+			mGrid->Threads().ParallelFor(static_cast<int>(vertices.size()), liftVertices);
+		}
+		else
+		{
+			std::memcpy(destination, vertices.data(), vertices.size() * sizeof(WaterGridVertex));
+		}
+		mMeshSink.End();
+
+		float latency = std::chrono::duration<float>(Clock::now() - mFrames[frame].requested).count();
+		mStats.framesPresented++;
+		mStats.lastLatency = latency;
+		mStats.averageLatency += (latency - mStats.averageLatency) / mStats.framesPresented;
+		mStats.maxLatency = std::max(mStats.maxLatency, latency);
+	}
+	else if (!mWaitingForFirst)
+	{
+		mStats.missedDeadlines++;
+	}
+
+	// Ask for the next step. If the previous request has not been picked up yet the simulation is running behind,
+	// and only the newest time is worth simulating, so it simply replaces the old one
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mHasRequest = true;
+		mRequestTime = nextTime;
+		mRequested = Clock::now();
+	}
+	mWake.notify_all();
+	mWaitingForFirst = false;
+
+	return frame >= 0;
+}
+
+
+int WaveSimulationThread::FreeBuffer() const
+{
+	for (int i = 0; i < static_cast<int>(mFrames.size()); ++i)
+	{
+		if (i != mReady && i != mShown)  return i;
+	}
+	return -1;
+}
+
+void WaveSimulationThread::SimulationLoop()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (true)
+	{
+		// With two buffers this waits while one holds an unshown step and the other is on screen
+		mWake.wait(lock, [this] { return mQuit || (mHasRequest && FreeBuffer() >= 0); });
+		if (mQuit)  return;
+
+		int frame = FreeBuffer();
+		float time = mRequestTime;
+		Clock::time_point requested = mRequested;
+		mHasRequest = false;
+		lock.unlock();
+
+		auto start = Clock::now();
+		try
+		{
+			mGrid->SetVertexSink(&mFrames[frame].vertices);
+			mGrid->WavesEvaluationFFT(time);
+			mFrames[frame].queryTexels = mGrid->QueryTexels();
+		}
+		catch (...)
+		{
+			// Left for Update to rethrow on the render thread; the thread stops here
+			lock.lock();
+			mError = std::current_exception();
+			mQuit = true;
+			return;
+		}
+		mFrames[frame].requested = requested;
+		float stepTime = std::chrono::duration<float>(Clock::now() - start).count();
+
+		lock.lock();
+		if (mReady >= 0)  mDropped++; // Replaced before the render thread got to it
+		mReady = frame;
+		mStepTime = stepTime;
+	}
+}
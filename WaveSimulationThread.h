@@ -0,0 +1,111 @@
+//--------------------------------------------------------------------------------------
+// Runs a CWaveGrid on its own thread, one frame ahead of rendering
+//--------------------------------------------------------------------------------------
+// Each rendered frame uploads the newest finished simulation step and asks for the next one,
+// which is then simulated while the frame is being rendered. Finished steps go into a small
+// ring of CPU-side vertex buffers (two or three), so the render thread never waits for the
+// simulation: it takes whatever is newest, or keeps showing the last step if nothing new is
+// ready. While the thread exists the grid belongs to it - don't call the grid directly, other than
+// QuerySurface. Each buffer keeps the query texels of its step too, and the grid is pointed at
+// those of the step on screen, so queries match what is drawn. The grid's ripples are taken
+// over as well and added as each step is uploaded, so they can be updated every frame.
+
+#ifndef _WAVE_SIMULATION_THREAD_H_INCLUDED_
+#define _WAVE_SIMULATION_THREAD_H_INCLUDED_
+
+#include "CWaterGrid.h"
+#include "WaterVertexSink.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <vector>
+#include <stdint.h>
+
+class WaveSimulationThread
+{
+public:
+
+	// Construction //
+
+	// numBuffers is 2 (double buffering) or 3 (triple buffering, the simulation never waits for the render thread)
+	WaveSimulationThread(CWaveGrid* grid, int numBuffers = 2);
+
+	// Finishes the step in progress, stops the thread and hands the grid back its mesh, queries and ripples
+	~WaveSimulationThread();
+
+
+	// Usage //
+
+	// Call once per frame, on the render thread. Uploads the newest finished step to the grid mesh, then asks for
+	// the surface at nextTime (normally the current time plus the expected frame time) to be simulated in the
+	// background. Returns false if no new step had finished since the last call, i.e. the deadline was missed, in
+	// which case the mesh and queries keep the old step and its ripples. Rethrows anything a step threw on the
+	// simulation thread, which has then stopped
+	bool Update(float nextTime);
+
+	struct Stats
+	{
+		uint64_t framesPresented = 0; // Steps uploaded to the mesh
+		uint64_t missedDeadlines = 0; // Updates that found no new step ready and kept the old surface
+		uint64_t framesDropped   = 0; // Steps finished but overtaken by a newer one before they could be shown
+		float    lastLatency     = 0; // Seconds from asking for the last shown step to uploading it
+		float    averageLatency  = 0; // Over every presented step
+		float    maxLatency      = 0;
+		float    lastStepTime    = 0; // Seconds the simulation thread spent on the last step
+
+		// The grid's settings, which cannot change while the thread owns it
+		int          size            = 0;
+		int          numCascades     = 0;
+		unsigned int threadCount     = 0;
+		float        bandRefreshRate = 0;
+		bool         hasBathymetry   = false;
+	};
+
+	// Counters so far. Render thread only
+	const Stats& GetStats() const { return mStats; }
+
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Frame
+	{
+		CpuVertexSink     vertices;
+		AlignedVector<CWaveGrid::QueryTexel> queryTexels;
+		Clock::time_point requested;
+	};
+
+	void SimulationLoop();
+
+	// Buffer that is neither the newest finished step nor the one on screen, or -1. Call with mMutex held
+	int FreeBuffer() const;
+
+	CWaveGrid*      mGrid;
+	MeshVertexSink  mMeshSink;
+	const InteractiveWaves* mRipples; // Taken from the grid, or null
+	std::vector<Frame> mFrames;
+
+	std::thread             mThread;
+	std::mutex              mMutex;
+	std::condition_variable mWake;
+
+	// Shared with the simulation thread, under mMutex
+	bool              mHasRequest;
+	float             mRequestTime;
+	Clock::time_point mRequested;
+	int               mReady;     // Newest finished step not yet uploaded, or -1
+	int               mShown;     // Step last uploaded, whose texels the grid is queried with
+	uint64_t          mDropped;
+	float             mStepTime;
+	bool              mQuit;
+	std::exception_ptr mError;    // Thrown by the last step, which stopped the thread
+
+	// Render thread only
+	Stats mStats;
+	bool  mWaitingForFirst;
+};
+
+
+#endif //_WAVE_SIMULATION_THREAD_H_INCLUDED_
@@ -0,0 +1,248 @@
+/**
+ * Planned 1D transforms for Simple-FFT.
+ *
+ * A plan is created once for a given size and direction and holds everything
+ * the transform needs that does not depend on the data: the bit-reversal
+ * permutation as a list of swaps and the twiddle factors of every butterfly
+ * stage, laid out stage after stage so each stage reads them sequentially.
+ * Executing a plan does no trigonometry and no bit manipulation.
+ *
+ * Unlike FFT/IFFT, a planned transform is not scaled in either direction, and
+ * its precision is a template parameter rather than the global real_type:
+ * FFTPlan is the real_type plan, BasicFFTPlan<float> a single-precision one.
+ *
+ * execute() runs a single, possibly strided, transform with radix-2 butterflies.
+ * executeBatch() runs many transforms stored side by side through the radix-4
+ * SIMD kernels of fft_simd.hpp; a 2D transform is a batch over the columns,
+ * a transposeSquare() and another batch.
+ */
+
+#ifndef __SIMPLE_FFT__FFT_PLAN_HPP__
+#define __SIMPLE_FFT__FFT_PLAN_HPP__
+
+#include "fft_settings.h"
+#include "fft_impl.hpp"
+#include "fft_simd.hpp"
+#include "error_handling.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+using std::size_t;
+
+namespace simple_fft {
+
+template <class TReal>
+class BasicFFTPlan
+{
+public:
+    typedef TReal real;
+    typedef std::complex<TReal> complex;
+
+    BasicFFTPlan() : m_size(0), m_backward(false), m_isa(simd::ISA_SCALAR), m_batch_kernel(0) {}
+
+    // (Re)builds the tables for transforms of the given size and direction. Batched transforms use
+    // the requested instruction set, or the best one the machine supports if that is narrower.
+    bool init(const size_t size, const impl::FFT_direction fft_direction,
+              const char *& error_description,
+              const simd::InstructionSet isa = simd::bestInstructionSet())
+    {
+        using namespace error_handling;
+
+        if (!impl::checkNumElements(size, error_description)) {
+            return false;
+        }
+
+        double local_pi;
+        switch(fft_direction)
+        {
+        case(impl::FFT_FORWARD):
+            local_pi = -M_PI;
+            break;
+        case(impl::FFT_BACKWARD):
+            local_pi = M_PI;
+            break;
+        default:
+            GetErrorDescription(EC_WRONG_FFT_DIRECTION, error_description);
+            return false;
+        }
+
+        m_size = size;
+        m_backward = (fft_direction == impl::FFT_BACKWARD);
+        m_isa = std::min(isa, simd::bestInstructionSet());
+        m_batch_kernel = simd::batchKernel<TReal>(m_isa);
+
+        // bit-reversal permutation, stored as the swaps it takes to apply it
+        m_swap_from.clear();
+        m_swap_to.clear();
+        size_t num_bits = 0;
+        while ((size_t(1) << num_bits) < size) ++num_bits;
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            size_t reversed = 0;
+            for (size_t bit = 0; bit < num_bits; ++bit) {
+                reversed |= ((i >> bit) & 1) << (num_bits - 1 - bit);
+            }
+            if (reversed > i) {
+                m_swap_from.push_back(i);
+                m_swap_to.push_back(reversed);
+            }
+        }
+
+        // twiddles for the stage with half-length h start at offset h - 1
+        m_twiddles.resize(size > 1 ? size - 1 : 0);
+        for (size_t half = 1, offset = 0; half < size; offset += half, half <<= 1)
+        {
+            for (size_t k = 0; k < half; ++k)
+            {
+                double angle = local_pi * k / half;
+                m_twiddles[offset + k] = complex(static_cast<real>(std::cos(angle)),
+                                                 static_cast<real>(std::sin(angle)));
+            }
+        }
+
+        // radix-4 passes of the batched kernels: for quarter length h, the triples (w, w^2, w^3) with
+        // w = exp(+-i pi k / 2h), k < h. The first pass is radix-2 with unit twiddles when log2(size) is odd.
+        m_batch_twiddles.clear();
+        size_t quarter = (num_bits & 1) ? 2 : 1;
+        for (; quarter < size; quarter <<= 2)
+        {
+            for (size_t k = 0; k < quarter; ++k)
+            {
+                for (size_t power = 1; power <= 3; ++power)
+                {
+                    double angle = local_pi * k * power / (2 * quarter);
+                    m_batch_twiddles.push_back(static_cast<real>(std::cos(angle)));
+                    m_batch_twiddles.push_back(static_cast<real>(std::sin(angle)));
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Makes room in the tables for sizes up to max_size, so that init does not allocate for them
+    void reserve(const size_t max_size)
+    {
+        m_swap_from.reserve(max_size / 2);
+        m_swap_to.reserve(max_size / 2);
+        m_twiddles.reserve(max_size);
+        m_batch_twiddles.reserve(2 * max_size);
+    }
+
+    size_t size() const { return m_size; }
+    simd::InstructionSet instructionSet() const { return m_isa; }
+
+    // In-place transform of data[0], data[stride], ..., data[(size - 1) * stride]
+    void execute(complex * data, const size_t stride = 1) const
+    {
+        const size_t num_swaps = m_swap_from.size();
+        for (size_t i = 0; i < num_swaps; ++i)
+        {
+            complex buf = data[m_swap_from[i] * stride];
+            data[m_swap_from[i] * stride] = data[m_swap_to[i] * stride];
+            data[m_swap_to[i] * stride] = buf;
+        }
+
+        const complex * factor = m_twiddles.data();
+        complex product;
+
+        for (size_t half = 1; half < m_size; half <<= 1)
+        {
+            const size_t next = half << 1;
+            for (size_t start = 0; start < m_size; start += next)
+            {
+                complex * lower = data + start * stride;
+                complex * upper = lower + half * stride;
+                for (size_t k = 0; k < half; ++k)
+                {
+                    product = *upper * factor[k];
+                    *upper = *lower - product;
+                    *lower += product;
+                    lower += stride;
+                    upper += stride;
+                }
+            }
+            factor += half;
+        }
+    }
+
+    // In-place transform of count sequences stored side by side: element j of sequence b is
+    // data[b + j * stride], with stride >= count. Vectorized across the sequences.
+    void executeBatch(complex * data, const size_t count, const size_t stride) const
+    {
+        const size_t num_swaps = m_swap_from.size();
+        for (size_t i = 0; i < num_swaps; ++i)
+        {
+            complex * from = data + m_swap_from[i] * stride;
+            std::swap_ranges(from, from + count, data + m_swap_to[i] * stride);
+        }
+
+        m_batch_kernel(reinterpret_cast<real *>(data), count, stride, m_size,
+                       m_batch_twiddles.data(), m_backward);
+    }
+
+private:
+    size_t m_size;
+    bool m_backward;
+    simd::InstructionSet m_isa;
+    typename simd::BatchKernel<TReal>::type m_batch_kernel;
+    std::vector<size_t> m_swap_from;
+    std::vector<size_t> m_swap_to;
+    std::vector<complex> m_twiddles;
+    std::vector<real> m_batch_twiddles;
+};
+
+typedef BasicFFTPlan<real_type> FFTPlan;
+
+const size_t transpose_tile = 16;
+
+// Number of tile rows transposeSquareTiles() splits a size x size matrix into
+inline size_t transposeTileRows(const size_t size)
+{
+    return (size + transpose_tile - 1) / transpose_tile;
+}
+
+// Swaps the tiles in tile rows [tile_row_begin, tile_row_end) of an in-place transpose with their mirror
+// images. Disjoint ranges touch disjoint elements, so they can run on different threads.
+template <class TComplex>
+inline void transposeSquareTiles(TComplex * data, const size_t size, const size_t pitch,
+                                 const size_t tile_row_begin, const size_t tile_row_end)
+{
+    for (size_t row_start = tile_row_begin * transpose_tile;
+         row_start < std::min(tile_row_end * transpose_tile, size); row_start += transpose_tile)
+    {
+        const size_t row_end = std::min(row_start + transpose_tile, size);
+        for (size_t col_start = row_start; col_start < size; col_start += transpose_tile)
+        {
+            const size_t col_end = std::min(col_start + transpose_tile, size);
+            for (size_t row = row_start; row < row_end; ++row)
+            {
+                for (size_t col = (col_start == row_start ? row + 1 : col_start); col < col_end; ++col) {
+                    std::swap(data[row * pitch + col], data[col * pitch + row]);
+                }
+            }
+        }
+    }
+}
+
+// In-place transpose of a size x size matrix whose rows start pitch elements apart, a cache-sized
+// tile at a time. With pitch > size several matrices can share rows, e.g. fields stored side by side.
+template <class TComplex>
+inline void transposeSquare(TComplex * data, const size_t size, const size_t pitch)
+{
+    transposeSquareTiles(data, size, pitch, 0, transposeTileRows(size));
+}
+
+template <class TComplex>
+inline void transposeSquare(TComplex * data, const size_t size)
+{
+    transposeSquare(data, size, size);
+}
+
+} // namespace simple_fft
+
+#endif // __SIMPLE_FFT__FFT_PLAN_HPP__
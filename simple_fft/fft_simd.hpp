@@ -0,0 +1,379 @@
+/**
+ * Vectorized batched butterflies for Simple-FFT plans.
+ *
+ * A batch is a set of equally sized transforms laid out side by side: element
+ * j of transform b lives at data[b + j * stride]. The kernels vectorize across
+ * the transforms of a batch, so every lane of a register sees the same twiddle
+ * factor and no shuffling is needed between stages. Two radix-2 stages are
+ * fused into one radix-4 pass (radix-2^2), halving the number of sweeps over
+ * memory; the quarter-turn twiddle of the fused stage is applied as a swap and
+ * sign flip rather than a multiplication.
+ *
+ * The kernels are written once in fft_simd_kernels.inl and compiled for each
+ * instruction set by including that file in its own namespace, for both float
+ * and double. The best set supported by the CPU and the OS is picked at runtime.
+ */
+
+#ifndef __SIMPLE_FFT__FFT_SIMD_HPP__
+#define __SIMPLE_FFT__FFT_SIMD_HPP__
+
+#include <complex>
+#include <cstddef>
+
+#if !defined(__SIMPLE_FFT_DISABLE_SIMD) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#define __SIMPLE_FFT_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+using std::size_t;
+
+namespace simple_fft {
+namespace simd {
+
+enum InstructionSet
+{
+    ISA_SCALAR = 0,
+    ISA_SSE2,
+    ISA_AVX2,
+    ISA_AVX512
+};
+
+inline const char * instructionSetName(const InstructionSet isa)
+{
+    switch(isa)
+    {
+    case ISA_SSE2:   return "SSE2";
+    case ISA_AVX2:   return "AVX2";
+    case ISA_AVX512: return "AVX-512";
+    default:         return "scalar";
+    }
+}
+
+#ifdef __SIMPLE_FFT_X86_SIMD
+
+inline void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i = 0; i < 4; ++i) regs[i] = static_cast<unsigned int>(info[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+inline unsigned long long xgetbv0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (static_cast<unsigned long long>(hi) << 32) | lo;
+#endif
+}
+
+// The widest instruction set both the CPU and the OS (register state saving) support
+inline InstructionSet detectInstructionSet()
+{
+    unsigned int regs[4];
+    cpuid(0, 0, regs);
+    const unsigned int max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    const bool sse2 = (regs[3] & (1u << 26)) != 0;
+    const bool fma = (regs[2] & (1u << 12)) != 0;
+    const bool osxsave = (regs[2] & (1u << 27)) != 0;
+    const bool avx = (regs[2] & (1u << 28)) != 0;
+    if (!sse2) return ISA_SCALAR;
+    if (!osxsave || !avx || max_leaf < 7) return ISA_SSE2;
+
+    const unsigned long long xcr0 = xgetbv0();
+    if ((xcr0 & 0x6) != 0x6) return ISA_SSE2;
+
+    cpuid(7, 0, regs);
+    const bool avx2 = (regs[1] & (1u << 5)) != 0;
+    const bool avx512f = (regs[1] & (1u << 16)) != 0;
+    if (avx512f && (xcr0 & 0xE6) == 0xE6) return ISA_AVX512;
+    if (avx2 && fma) return ISA_AVX2;
+    return ISA_SSE2;
+}
+
+#else
+
+inline InstructionSet detectInstructionSet()
+{
+    return ISA_SCALAR;
+}
+
+#endif
+
+inline InstructionSet bestInstructionSet()
+{
+    static const InstructionSet isa = detectInstructionSet();
+    return isa;
+}
+
+// One complex value per "vector"; used for tails narrower than a register and where no SIMD is available
+template <class TReal>
+struct ScalarVec
+{
+    typedef TReal real;
+    typedef std::complex<TReal> V;
+    enum { width = 1 };
+
+    static inline V load(const real * p) { return V(p[0], p[1]); }
+    static inline void store(real * p, const V & v) { p[0] = v.real(); p[1] = v.imag(); }
+    static inline V set1(const real re, const real im) { return V(re, im); }
+    static inline V add(const V & a, const V & b) { return a + b; }
+    static inline V sub(const V & a, const V & b) { return a - b; }
+    static inline V mul(const V & a, const V & factor)
+    {
+        // spelled out: operator* would go through the C99 NaN/inf recovery of __mulsc3/__muldc3
+        return V(a.real() * factor.real() - a.imag() * factor.imag(),
+                 a.real() * factor.imag() + a.imag() * factor.real());
+    }
+    static inline V mulI(const V & a) { return V(-a.imag(), a.real()); }
+    static inline V mulNegI(const V & a) { return V(a.imag(), -a.real()); }
+};
+
+// Executes every butterfly stage of a batch that has already been bit-reverse permuted.
+// twiddles holds, for each radix-4 pass with quarter length h, h triples (w, w^2, w^3) stored re/im interleaved.
+template <class TReal>
+struct BatchKernel
+{
+    typedef void (*type)(TReal * data, const size_t count, const size_t stride, const size_t size,
+                         const TReal * twiddles, const bool backward);
+};
+
+namespace scalar {
+typedef ScalarVec<float> VecFloat;
+typedef ScalarVec<double> VecDouble;
+#include "fft_simd_kernels.inl"
+} // namespace scalar
+
+#ifdef __SIMPLE_FFT_X86_SIMD
+
+// ---- SSE2: one complex double or two complex floats per register ----
+namespace sse2 {
+struct VecDouble
+{
+    typedef double real;
+    typedef __m128d V;
+    enum { width = 1 };
+
+    static inline V load(const real * p) { return _mm_loadu_pd(p); }
+    static inline void store(real * p, const V v) { _mm_storeu_pd(p, v); }
+    static inline V set1(const real re, const real im) { return _mm_set_pd(im, re); }
+    static inline V add(const V a, const V b) { return _mm_add_pd(a, b); }
+    static inline V sub(const V a, const V b) { return _mm_sub_pd(a, b); }
+    static inline V mul(const V a, const V factor)
+    {
+        const V re = _mm_unpacklo_pd(factor, factor);
+        const V im = _mm_unpackhi_pd(factor, factor);
+        const V swapped = _mm_shuffle_pd(a, a, 1);
+        return _mm_add_pd(_mm_mul_pd(a, re), _mm_xor_pd(_mm_mul_pd(swapped, im), _mm_set_pd(0.0, -0.0)));
+    }
+    static inline V mulI(const V a) { return _mm_xor_pd(_mm_shuffle_pd(a, a, 1), _mm_set_pd(0.0, -0.0)); }
+    static inline V mulNegI(const V a) { return _mm_xor_pd(_mm_shuffle_pd(a, a, 1), _mm_set_pd(-0.0, 0.0)); }
+};
+
+struct VecFloat
+{
+    typedef float real;
+    typedef __m128 V;
+    enum { width = 2 };
+
+    static inline V load(const real * p) { return _mm_loadu_ps(p); }
+    static inline void store(real * p, const V v) { _mm_storeu_ps(p, v); }
+    static inline V set1(const real re, const real im) { return _mm_set_ps(im, re, im, re); }
+    static inline V add(const V a, const V b) { return _mm_add_ps(a, b); }
+    static inline V sub(const V a, const V b) { return _mm_sub_ps(a, b); }
+    static inline V mul(const V a, const V factor)
+    {
+        const V re = _mm_shuffle_ps(factor, factor, _MM_SHUFFLE(2, 2, 0, 0));
+        const V im = _mm_shuffle_ps(factor, factor, _MM_SHUFFLE(3, 3, 1, 1));
+        const V swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_add_ps(_mm_mul_ps(a, re), _mm_xor_ps(_mm_mul_ps(swapped, im), _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f)));
+    }
+    static inline V mulI(const V a)
+    {
+        return _mm_xor_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)), _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f));
+    }
+    static inline V mulNegI(const V a)
+    {
+        return _mm_xor_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)), _mm_set_ps(-0.0f, 0.0f, -0.0f, 0.0f));
+    }
+};
+#include "fft_simd_kernels.inl"
+} // namespace sse2
+
+// ---- AVX2 + FMA: two complex doubles or four complex floats per register ----
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace avx2 {
+struct VecDouble
+{
+    typedef double real;
+    typedef __m256d V;
+    enum { width = 2 };
+
+    static inline V load(const real * p) { return _mm256_loadu_pd(p); }
+    static inline void store(real * p, const V v) { _mm256_storeu_pd(p, v); }
+    static inline V set1(const real re, const real im) { return _mm256_set_pd(im, re, im, re); }
+    static inline V add(const V a, const V b) { return _mm256_add_pd(a, b); }
+    static inline V sub(const V a, const V b) { return _mm256_sub_pd(a, b); }
+    static inline V mul(const V a, const V factor)
+    {
+        const V re = _mm256_movedup_pd(factor);
+        const V im = _mm256_permute_pd(factor, 0xF);
+        return _mm256_fmaddsub_pd(a, re, _mm256_mul_pd(_mm256_permute_pd(a, 0x5), im));
+    }
+    static inline V mulI(const V a) { return _mm256_xor_pd(_mm256_permute_pd(a, 0x5), _mm256_set_pd(0.0, -0.0, 0.0, -0.0)); }
+    static inline V mulNegI(const V a) { return _mm256_xor_pd(_mm256_permute_pd(a, 0x5), _mm256_set_pd(-0.0, 0.0, -0.0, 0.0)); }
+};
+
+struct VecFloat
+{
+    typedef float real;
+    typedef __m256 V;
+    enum { width = 4 };
+
+    static inline V load(const real * p) { return _mm256_loadu_ps(p); }
+    static inline void store(real * p, const V v) { _mm256_storeu_ps(p, v); }
+    static inline V set1(const real re, const real im) { return _mm256_set_ps(im, re, im, re, im, re, im, re); }
+    static inline V add(const V a, const V b) { return _mm256_add_ps(a, b); }
+    static inline V sub(const V a, const V b) { return _mm256_sub_ps(a, b); }
+    static inline V mul(const V a, const V factor)
+    {
+        const V re = _mm256_moveldup_ps(factor);
+        const V im = _mm256_movehdup_ps(factor);
+        return _mm256_fmaddsub_ps(a, re, _mm256_mul_ps(_mm256_permute_ps(a, 0xB1), im));
+    }
+    static inline V mulI(const V a)
+    {
+        return _mm256_xor_ps(_mm256_permute_ps(a, 0xB1), _mm256_set_ps(0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f));
+    }
+    static inline V mulNegI(const V a)
+    {
+        return _mm256_xor_ps(_mm256_permute_ps(a, 0xB1), _mm256_set_ps(-0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f));
+    }
+};
+#include "fft_simd_kernels.inl"
+} // namespace avx2
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+// ---- AVX-512F: four complex doubles or eight complex floats per register ----
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#endif
+namespace avx512 {
+struct VecDouble
+{
+    typedef double real;
+    typedef __m512d V;
+    enum { width = 4 };
+
+    static inline V load(const real * p) { return _mm512_loadu_pd(p); }
+    static inline void store(real * p, const V v) { _mm512_storeu_pd(p, v); }
+    static inline V set1(const real re, const real im) { return _mm512_set_pd(im, re, im, re, im, re, im, re); }
+    static inline V add(const V a, const V b) { return _mm512_add_pd(a, b); }
+    static inline V sub(const V a, const V b) { return _mm512_sub_pd(a, b); }
+    static inline V mul(const V a, const V factor)
+    {
+        const V re = _mm512_shuffle_pd(factor, factor, 0x00);
+        const V im = _mm512_shuffle_pd(factor, factor, 0xFF);
+        return _mm512_fmaddsub_pd(a, re, _mm512_mul_pd(_mm512_shuffle_pd(a, a, 0x55), im));
+    }
+    static inline V mulI(const V a)
+    {
+        const V swapped = _mm512_shuffle_pd(a, a, 0x55);
+        return _mm512_mask_sub_pd(swapped, 0x55, _mm512_setzero_pd(), swapped);
+    }
+    static inline V mulNegI(const V a)
+    {
+        const V swapped = _mm512_shuffle_pd(a, a, 0x55);
+        return _mm512_mask_sub_pd(swapped, 0xAA, _mm512_setzero_pd(), swapped);
+    }
+};
+
+struct VecFloat
+{
+    typedef float real;
+    typedef __m512 V;
+    enum { width = 8 };
+
+    static inline V load(const real * p) { return _mm512_loadu_ps(p); }
+    static inline void store(real * p, const V v) { _mm512_storeu_ps(p, v); }
+    static inline V set1(const real re, const real im)
+    {
+        return _mm512_set_ps(im, re, im, re, im, re, im, re, im, re, im, re, im, re, im, re);
+    }
+    static inline V add(const V a, const V b) { return _mm512_add_ps(a, b); }
+    static inline V sub(const V a, const V b) { return _mm512_sub_ps(a, b); }
+    static inline V mul(const V a, const V factor)
+    {
+        const V re = _mm512_shuffle_ps(factor, factor, _MM_SHUFFLE(2, 2, 0, 0));
+        const V im = _mm512_shuffle_ps(factor, factor, _MM_SHUFFLE(3, 3, 1, 1));
+        return _mm512_fmaddsub_ps(a, re, _mm512_mul_ps(_mm512_shuffle_ps(a, a, 0xB1), im));
+    }
+    static inline V mulI(const V a)
+    {
+        const V swapped = _mm512_shuffle_ps(a, a, 0xB1);
+        return _mm512_mask_sub_ps(swapped, 0x5555, _mm512_setzero_ps(), swapped);
+    }
+    static inline V mulNegI(const V a)
+    {
+        const V swapped = _mm512_shuffle_ps(a, a, 0xB1);
+        return _mm512_mask_sub_ps(swapped, 0xAAAA, _mm512_setzero_ps(), swapped);
+    }
+};
+#include "fft_simd_kernels.inl"
+} // namespace avx512
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif // __SIMPLE_FFT_X86_SIMD
+
+// Kernel for the requested instruction set, falling back to what the machine actually supports
+template <class TReal>
+inline typename BatchKernel<TReal>::type batchKernel(InstructionSet isa)
+{
+    typedef typename BatchKernel<TReal>::type kernel_type;
+
+    if (isa > bestInstructionSet()) isa = bestInstructionSet();
+
+    switch(isa)
+    {
+#ifdef __SIMPLE_FFT_X86_SIMD
+    case ISA_AVX512: return static_cast<kernel_type>(&avx512::executeBatch);
+    case ISA_AVX2:   return static_cast<kernel_type>(&avx2::executeBatch);
+    case ISA_SSE2:   return static_cast<kernel_type>(&sse2::executeBatch);
+#endif
+    default:         return static_cast<kernel_type>(&scalar::executeBatch);
+    }
+}
+
+} // namespace simd
+} // namespace simple_fft
+
+#endif // __SIMPLE_FFT__FFT_SIMD_HPP__
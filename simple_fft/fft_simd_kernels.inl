@@ -0,0 +1,142 @@
+/**
+ * Batched butterfly kernels, written against vector traits TVec.
+ *
+ * No include guard: fft_simd.hpp includes this file once per instruction set,
+ * each time inside its own namespace, so the same source is compiled for every
+ * target. Pointers and offsets are in reals, two per complex value; "count"
+ * transforms are processed side by side, TVec::width at a time, with ScalarVec
+ * picking up whatever is left over.
+ */
+
+// Radix-2 butterflies with unit twiddles: the first stage when log2(size) is odd
+template <class TVec>
+inline size_t radix2UnitLanes(typename TVec::real * lower, typename TVec::real * upper,
+                              size_t b, const size_t count)
+{
+    typedef typename TVec::V V;
+
+    for (; b + TVec::width <= count; b += TVec::width)
+    {
+        const V a0 = TVec::load(lower + 2 * b);
+        const V a1 = TVec::load(upper + 2 * b);
+        TVec::store(lower + 2 * b, TVec::add(a0, a1));
+        TVec::store(upper + 2 * b, TVec::sub(a0, a1));
+    }
+    return b;
+}
+
+// Two fused radix-2 stages. With t = w^(1/2) the twiddle of the wider stage, the four
+// inputs are weighted by 1, t^2, t, t^3; the wider stage's second twiddle is t times a
+// quarter turn, applied as mulI/mulNegI.
+template <class TVec, bool Backward, bool Unit>
+inline size_t radix4Lanes(typename TVec::real * p0, typename TVec::real * p1,
+                          typename TVec::real * p2, typename TVec::real * p3,
+                          size_t b, const size_t count, const typename TVec::real * t)
+{
+    typedef typename TVec::V V;
+
+    const V w1 = TVec::set1(t[0], t[1]);
+    const V w2 = TVec::set1(t[2], t[3]);
+    const V w3 = TVec::set1(t[4], t[5]);
+
+    for (; b + TVec::width <= count; b += TVec::width)
+    {
+        const size_t offset = 2 * b;
+        V a0 = TVec::load(p0 + offset);
+        V a1 = TVec::load(p1 + offset);
+        V a2 = TVec::load(p2 + offset);
+        V a3 = TVec::load(p3 + offset);
+
+        if (!Unit) {
+            a1 = TVec::mul(a1, w2);
+            a2 = TVec::mul(a2, w1);
+            a3 = TVec::mul(a3, w3);
+        }
+
+        const V u0 = TVec::add(a0, a1);
+        const V u1 = TVec::sub(a0, a1);
+        const V v0 = TVec::add(a2, a3);
+        const V v1 = Backward ? TVec::mulI(TVec::sub(a2, a3)) : TVec::mulNegI(TVec::sub(a2, a3));
+
+        TVec::store(p0 + offset, TVec::add(u0, v0));
+        TVec::store(p1 + offset, TVec::add(u1, v1));
+        TVec::store(p2 + offset, TVec::sub(u0, v0));
+        TVec::store(p3 + offset, TVec::sub(u1, v1));
+    }
+    return b;
+}
+
+template <class TVec, bool Backward>
+inline void radix4Pass(typename TVec::real * data, const size_t count, const size_t stride,
+                       const size_t size, const size_t quarter, const typename TVec::real * twiddles)
+{
+    typedef typename TVec::real real;
+    typedef ScalarVec<real> Tail;
+
+    const size_t quarter_offset = 2 * quarter * stride;
+
+    for (size_t start = 0; start < size; start += 4 * quarter)
+    {
+        for (size_t k = 0; k < quarter; ++k)
+        {
+            real * p0 = data + 2 * (start + k) * stride;
+            real * p1 = p0 + quarter_offset;
+            real * p2 = p1 + quarter_offset;
+            real * p3 = p2 + quarter_offset;
+            const real * t = twiddles + 6 * k;
+
+            size_t b;
+            if (k == 0) {
+                b = radix4Lanes<TVec, Backward, true>(p0, p1, p2, p3, 0, count, t);
+                radix4Lanes<Tail, Backward, true>(p0, p1, p2, p3, b, count, t);
+            }
+            else {
+                b = radix4Lanes<TVec, Backward, false>(p0, p1, p2, p3, 0, count, t);
+                radix4Lanes<Tail, Backward, false>(p0, p1, p2, p3, b, count, t);
+            }
+        }
+    }
+}
+
+template <class TVec>
+inline void executeBatchWith(typename TVec::real * data, const size_t count, const size_t stride,
+                             const size_t size, const typename TVec::real * twiddles, const bool backward)
+{
+    typedef typename TVec::real real;
+
+    size_t num_stages = 0;
+    while ((size_t(1) << num_stages) < size) ++num_stages;
+
+    size_t quarter = 1;
+    if (num_stages & 1)
+    {
+        for (size_t start = 0; start < size; start += 2)
+        {
+            real * lower = data + 2 * start * stride;
+            real * upper = lower + 2 * stride;
+            const size_t b = radix2UnitLanes<TVec>(lower, upper, 0, count);
+            radix2UnitLanes<ScalarVec<real> >(lower, upper, b, count);
+        }
+        quarter = 2;
+    }
+
+    for (; quarter < size; quarter <<= 2)
+    {
+        if (backward) radix4Pass<TVec, true>(data, count, stride, size, quarter, twiddles);
+        else radix4Pass<TVec, false>(data, count, stride, size, quarter, twiddles);
+        twiddles += 6 * quarter;
+    }
+}
+
+// Non-template entry points, one per precision, so every instantiation happens inside this target region
+inline void executeBatch(float * data, const size_t count, const size_t stride, const size_t size,
+                         const float * twiddles, const bool backward)
+{
+    executeBatchWith<VecFloat>(data, count, stride, size, twiddles, backward);
+}
+
+inline void executeBatch(double * data, const size_t count, const size_t stride, const size_t size,
+                         const double * twiddles, const bool backward)
+{
+    executeBatchWith<VecDouble>(data, count, stride, size, twiddles, backward);
+}